@@ -0,0 +1,57 @@
+/**
+
+MIT License
+
+Copyright (c) 2017 Dylan Hicks (aka. dylanh333)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+**/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _SHA1_H_
+#define _SHA1_H_
+
+#define SHA1_DIGEST_SIZE 20
+#define SHA1_BLOCK_SIZE 64
+
+/**
+ * Incremental SHA-1, as used by mkbootimg for the boot image ID.
+ */
+typedef struct {
+    uint32_t state[5];
+    uint64_t length; // bytes hashed so far
+    uint8_t block[SHA1_BLOCK_SIZE];
+    size_t blockLen;
+    // Hashes whole blocks, using SHA instructions if the CPU has them
+    void (*blocks)(uint32_t state[5], const uint8_t *blocks, size_t count);
+} sha1Context;
+
+void sha1Init(sha1Context *ctx);
+void sha1Update(sha1Context *ctx, const void *data, size_t size);
+void sha1Final(sha1Context *ctx, uint8_t digest[SHA1_DIGEST_SIZE]);
+
+/**
+ * Describes which implementation sha1Update() uses on this CPU.
+ */
+const char *sha1Implementation(void);
+
+#endif
@@ -0,0 +1,499 @@
+/**
+
+MIT License
+
+Copyright (c) 2017 Dylan Hicks (aka. dylanh333)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <getopt.h>
+
+#define throwError(message, ...) {\
+    fprintf(stderr, "Error in %s(): " message "\n", __func__, ##__VA_ARGS__);\
+    exit(EXIT_FAILURE);\
+}
+
+#define throwWarning(message, ...) \
+    fprintf(stderr, "Warning in %s(): " message "\n", __func__, ##__VA_ARGS__);
+
+// The page sizes that mkbootimg accepts, each of which gets its own images
+static const uint32_t pageSizes[] = { 2048, 4096, 8192, 16384 };
+#define PAGE_SIZES_LEN (sizeof(pageSizes) / sizeof(*pageSizes))
+
+#define MAX_SLICE_SIZES 16
+#define MAX_IMAGES (PAGE_SIZES_LEN * MAX_SLICE_SIZES)
+#define MAX_RUNS 1000
+
+// How many images the batch header scan goes through per run, repeating the
+// corpus as needed, so that per-image overheads dominate
+#define SCAN_BATCH_SIZE 1000
+
+// Slices are generated this much at a time
+#define GENERATE_CHUNK_SIZE (1024 * 1024)
+
+/**
+ * One image of the corpus. Its kernel is sliceSize bytes, its ramdisk half
+ * that, and its second-stage bootloader a sixteenth, each a little over so
+ * that none of them end on a page boundary.
+ */
+typedef struct {
+    char path[PATH_MAX];
+    char name[32];
+    uint32_t pageSize;
+    uint64_t sliceSize, size;
+} benchImage;
+
+/**
+ * The measurements of one way of running unmkbootimg over one image (or the
+ * whole corpus, for batch modes).
+ */
+typedef struct {
+    double seconds[MAX_RUNS];
+    size_t runs;
+    long maxRss; // KiB
+    uint64_t syscalls; // 0 if they couldn't be counted
+} benchResult;
+
+enum benchTarget {
+    TARGET_IMAGE, // run over each image in turn
+    TARGET_BATCH, // run over every image at once with -b
+    TARGET_SCAN // run over SCAN_BATCH_SIZE images with -b -f json
+};
+
+typedef struct {
+    const char *name;
+    const char *args[3]; // passed to unmkbootimg ahead of the image(s)
+    enum benchTarget target;
+    bool extracts; // whether throughput is meaningful
+} benchMode;
+
+static const benchMode benchModes[] = {
+    { "extract", { NULL }, TARGET_IMAGE, true },
+    { "extract -M", { "-M", NULL }, TARGET_IMAGE, true },
+    { "extract -p", { "-p", NULL }, TARGET_IMAGE, true },
+    { "header -i", { "-i", NULL }, TARGET_IMAGE, false },
+    { "batch extract", { "-b", NULL }, TARGET_BATCH, true },
+    { "batch scan", { "-b", "-f", "json" }, TARGET_SCAN, false }
+};
+#define BENCH_MODES_LEN (sizeof(benchModes) / sizeof(*benchModes))
+
+double getMonotonicTime(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Parses a size such as "16K", "1M" or "256M".
+ */
+uint64_t parseSize(const char *arg){
+    char *end;
+    unsigned long long value;
+
+    errno = 0;
+    value = strtoull(arg, &end, 0);
+    switch(*end){
+        case 'K': value <<= 10; end++; break;
+        case 'M': value <<= 20; end++; break;
+        case 'G': value <<= 30; end++; break;
+    }
+    if(errno || *end != '\0' || value == 0 || value > UINT32_MAX / 2)
+        throwError("Invalid slice size \"%s\"", arg);
+    return value;
+}
+
+/**
+ * Runs argv to completion with its output discarded, and returns false if it
+ * failed. Its wall time and peak RSS go in seconds and maxRss, and if syscalls
+ * is set, it's traced so that the syscalls made by all of its threads can be
+ * counted into it, in which case it's much slower.
+ */
+bool runCommand(
+    char *const argv[], double *seconds, long *maxRss, uint64_t *syscalls
+){
+    struct rusage usage;
+    double start = getMonotonicTime();
+    uint64_t stops = 0;
+    int status;
+    pid_t pid, tid;
+
+    if((pid = fork()) < 0) throwError(
+        "Failed to fork. %s", strerror(errno)
+    );
+    if(pid == 0){
+        int nullFd = open("/dev/null", O_WRONLY);
+
+        dup2(nullFd, STDOUT_FILENO);
+        if(syscalls){
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            raise(SIGSTOP);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    if(syscalls){
+        // Every syscall stops its thread twice, once on entry and once on
+        // exit, and new threads are traced as they're cloned
+        if(waitpid(pid, &status, 0) < 0 || ptrace(
+            PTRACE_SETOPTIONS, pid, NULL,
+            PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL
+        )){
+            throwWarning("Failed to trace syscalls. %s", strerror(errno));
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            *syscalls = 0;
+            return runCommand(argv, seconds, maxRss, NULL);
+        }
+        ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+        while((tid = wait4(-1, &status, __WALL, &usage)) > 0){
+            int signal = 0;
+
+            if(WIFEXITED(status) || WIFSIGNALED(status)){
+                if(tid == pid) break;
+                continue;
+            }
+            if(WSTOPSIG(status) == (SIGTRAP | 0x80)) stops++;
+            else if(WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP)
+                signal = WSTOPSIG(status);
+            ptrace(PTRACE_SYSCALL, tid, NULL, signal);
+        }
+        *syscalls = (stops + 1) / 2;
+    }else if(wait4(pid, &status, 0, &usage) < 0) throwError(
+        "Failed to wait for \"%s\". %s", argv[0], strerror(errno)
+    );
+
+    *seconds = getMonotonicTime() - start;
+    if(usage.ru_maxrss > *maxRss) *maxRss = usage.ru_maxrss;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Fills destPath with size bytes of pseudo-random data that depend only on
+ * seed, so that the corpus is the same from one run to the next.
+ */
+void generateSlice(const char *destPath, uint64_t size, uint64_t seed){
+    static uint64_t buffer[GENERATE_CHUNK_SIZE / sizeof(uint64_t)];
+    FILE *destFile = fopen(destPath, "w");
+
+    if(!destFile) throwError(
+        "Failed to open \"%s\". %s", destPath, strerror(errno)
+    );
+    seed |= 1;
+    for(uint64_t done = 0; done < size;){
+        size_t chunk = size - done < GENERATE_CHUNK_SIZE
+            ? size - done : GENERATE_CHUNK_SIZE;
+
+        // xorshift64
+        for(size_t i = 0; i < (chunk + 7) / 8; i++){
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            buffer[i] = seed;
+        }
+        if(fwrite(buffer, chunk, 1, destFile) != 1) throwError(
+            "Failed to write \"%s\". %s", destPath, strerror(errno)
+        );
+        done += chunk;
+    }
+    if(fclose(destFile)) throwError(
+        "Failed to write \"%s\". %s", destPath, strerror(errno)
+    );
+}
+
+/**
+ * Builds image with mkbootimg, unless it's already there from a previous run.
+ */
+void generateImage(
+    const benchImage *image, const char *corpusDir, const char *mkbootimg
+){
+    const char *names[] = { "kernel", "ramdisk", "second" };
+    uint64_t sizes[] = {
+        image->sliceSize + 123, image->sliceSize / 2 + 45,
+        image->sliceSize / 16 + 6
+    };
+    char slicePaths[3][PATH_MAX], pageSize[16];
+    struct stat imageStat;
+    double seconds;
+    long maxRss = 0;
+
+    if(stat(image->path, &imageStat) == 0 && imageStat.st_size > 0) return;
+    fprintf(stderr, "Generating \"%s\"...\n", image->path);
+
+    for(int i = 0; i < 3; i++){
+        snprintf(
+            slicePaths[i], PATH_MAX, "%s/.%s.%s", corpusDir, image->name,
+            names[i]
+        );
+        generateSlice(
+            slicePaths[i], sizes[i], image->sliceSize * 3 + image->pageSize + i
+        );
+    }
+    snprintf(pageSize, sizeof(pageSize), "%u", image->pageSize);
+
+    char *const argv[] = {
+        (char*)mkbootimg, "--kernel", slicePaths[0],
+        "--ramdisk", slicePaths[1], "--second", slicePaths[2],
+        "--pagesize", pageSize, "--cmdline", "console=ttyS0 bench",
+        "--board", "bench", "--os_version", "14.0.0",
+        "--os_patch_level", "2024-01-01", "-o", (char*)image->path, NULL
+    };
+    if(!runCommand(argv, &seconds, &maxRss, NULL)) throwError(
+        "Failed to generate \"%s\"", image->path
+    );
+    for(int i = 0; i < 3; i++) unlink(slicePaths[i]);
+}
+
+/**
+ * Returns the p'th percentile of the sorted times, by nearest rank.
+ */
+double getPercentile(const double *sorted, size_t len, double p){
+    size_t rank = (size_t)(p / 100 * len + 0.999999);
+
+    return sorted[rank ? rank - 1 : 0];
+}
+
+int compareDoubles(const void *a, const void *b){
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+void writeResultColumns(FILE *destFile){
+    fprintf(
+        destFile, "%-14s %-14s %9s %9s %9s %9s %9s %11s %9s\n",
+        "mode", "image", "MiB", "p50 ms", "p90 ms", "p99 ms", "MiB/s",
+        "syscall/MiB", "RSS KiB"
+    );
+}
+
+/**
+ * Writes one line of the results table. size is the bytes that each run went
+ * through, and items how many images.
+ */
+void writeResult(
+    FILE *destFile, const benchMode *mode, const char *name,
+    benchResult *result, uint64_t size, size_t items
+){
+    double mib = size / 1048576.0, p50;
+    char throughput[16] = "-", syscalls[16] = "-";
+
+    qsort(result->seconds, result->runs, sizeof(double), compareDoubles);
+    p50 = getPercentile(result->seconds, result->runs, 50);
+    if(mode->extracts) snprintf(
+        throughput, sizeof(throughput), "%.1f", mib / p50
+    );
+    else snprintf(
+        throughput, sizeof(throughput), "%.0f/s", items / p50
+    );
+    if(result->syscalls && size) snprintf(
+        syscalls, sizeof(syscalls), "%.1f", result->syscalls / mib
+    );
+    else if(result->syscalls) snprintf(
+        syscalls, sizeof(syscalls), "%.1f/img", (double)result->syscalls / items
+    );
+
+    fprintf(
+        destFile, "%-14s %-14s %9.2f %9.3f %9.3f %9.3f %9s %11s %9ld\n",
+        mode->name, name, mib, p50 * 1000,
+        getPercentile(result->seconds, result->runs, 90) * 1000,
+        getPercentile(result->seconds, result->runs, 99) * 1000,
+        throughput, syscalls, result->maxRss
+    );
+    fflush(destFile);
+}
+
+/**
+ * Runs argv once traced, to count its syscalls and warm the page cache, then
+ * runs times more to time it.
+ */
+void runBenchmark(char *const argv[], benchResult *result, size_t runs){
+    double seconds;
+
+    memset(result, 0, sizeof(*result));
+    if(!runCommand(argv, &seconds, &result->maxRss, &result->syscalls))
+        throwError("\"%s\" failed", argv[0]);
+    for(result->runs = 0; result->runs < runs; result->runs++)
+        if(!runCommand(
+            argv, &result->seconds[result->runs], &result->maxRss, NULL
+        )) throwError("\"%s\" failed", argv[0]);
+}
+
+void usage(char **args){
+    printf(
+        "Usage: %s [OPTIONS] <corpusDir>\n\n"
+        "Generates a corpus of synthetic boot images in corpusDir (if it\n"
+        "isn't already there), covering every page size from 2048 to 16384\n"
+        "for each slice size, then times unmkbootimg over them in each of\n"
+        "its modes. For each mode and image, this reports the latency\n"
+        "percentiles of a run, the throughput at the median, the syscalls\n"
+        "made per MiB of image (counted in a separate, traced run that\n"
+        "also warms the page cache), and the peak RSS.\n\n"
+        "OPTIONS:\n"
+        "\t-s <sizes>: Comma separated kernel sizes to generate images\n"
+        "\t\twith, eg. \"16K,1M,256M\" (the default).\n"
+        "\t-n <runs>: Time each mode this many times (default 5).\n"
+        "\t-u <unmkbootimg>: The unmkbootimg to benchmark (default\n"
+        "\t\tbin/unmkbootimg).\n"
+        "\t-m <mkbootimg>: The mkbootimg to generate the corpus with\n"
+        "\t\t(default bin/mkbootimg).\n",
+        args[0]
+    );
+}
+
+int main(int argsLen, char **args){
+    const char *corpusDir, *unmkbootimg = "bin/unmkbootimg";
+    const char *mkbootimg = "bin/mkbootimg";
+    char sizesArg[256] = "16K,1M,256M", outDir[PATH_MAX], listPath[PATH_MAX];
+    uint64_t sliceSizes[MAX_SLICE_SIZES], corpusSize = 0;
+    const char *sliceNames[MAX_SLICE_SIZES];
+    size_t sliceSizesLen = 0, imagesLen = 0, runs = 5;
+    static benchImage images[MAX_IMAGES];
+    static benchResult result;
+    char *argv[8 + MAX_IMAGES];
+
+    // Parse supplied arguments
+    int opt = 0;
+    while((opt = getopt(argsLen, args, "s:n:u:m:")) >= 0) switch(opt){
+        case 's': snprintf(sizesArg, sizeof(sizesArg), "%s", optarg); break;
+        case 'n': runs = strtoul(optarg, NULL, 0); break;
+        case 'u': unmkbootimg = optarg; break;
+        case 'm': mkbootimg = optarg; break;
+        default:
+            usage(args);
+            return EXIT_FAILURE;
+    }
+    if(optind != argsLen - 1 || runs < 1 || runs > MAX_RUNS){
+        usage(args);
+        return EXIT_FAILURE;
+    }
+    corpusDir = args[optind];
+    for(char *size = strtok(sizesArg, ","); size; size = strtok(NULL, ",")){
+        if(sliceSizesLen == MAX_SLICE_SIZES) throwError(
+            "Too many slice sizes: max %u", MAX_SLICE_SIZES
+        );
+        sliceNames[sliceSizesLen] = size;
+        sliceSizes[sliceSizesLen++] = parseSize(size);
+    }
+
+    // Generate the corpus
+    snprintf(outDir, PATH_MAX, "%s/out", corpusDir);
+    snprintf(listPath, PATH_MAX, "%s/scan.list", corpusDir);
+    if(mkdir(corpusDir, 0777) && errno != EEXIST) throwError(
+        "Failed to create \"%s\". %s", corpusDir, strerror(errno)
+    );
+    if(mkdir(outDir, 0777) && errno != EEXIST) throwError(
+        "Failed to create \"%s\". %s", outDir, strerror(errno)
+    );
+    for(size_t i = 0; i < sliceSizesLen; i++)
+    for(size_t j = 0; j < PAGE_SIZES_LEN; j++){
+        benchImage *image = &images[imagesLen++];
+        struct stat imageStat;
+
+        image->pageSize = pageSizes[j];
+        image->sliceSize = sliceSizes[i];
+        snprintf(
+            image->name, sizeof(image->name), "%.16s-p%u", sliceNames[i],
+            image->pageSize
+        );
+        snprintf(image->path, PATH_MAX, "%s/%s.img", corpusDir, image->name);
+        generateImage(image, corpusDir, mkbootimg);
+        if(stat(image->path, &imageStat)) throwError(
+            "Failed to stat \"%s\". %s", image->path, strerror(errno)
+        );
+        image->size = imageStat.st_size;
+        corpusSize += image->size;
+    }
+
+    FILE *listFile = fopen(listPath, "w");
+    if(!listFile) throwError(
+        "Failed to open \"%s\". %s", listPath, strerror(errno)
+    );
+    for(size_t i = 0; i < SCAN_BATCH_SIZE; i++)
+        fprintf(listFile, "%s\n", images[i % imagesLen].path);
+    fclose(listFile);
+
+    // Run each mode over the corpus
+    writeResultColumns(stdout);
+    for(size_t i = 0; i < BENCH_MODES_LEN; i++){
+        const benchMode *mode = &benchModes[i];
+        size_t argc = 0;
+
+        argv[argc++] = (char*)unmkbootimg;
+        for(size_t j = 0; j < 3 && mode->args[j]; j++)
+            argv[argc++] = (char*)mode->args[j];
+        argv[argc++] = "-d";
+        argv[argc++] = outDir;
+
+        switch(mode->target){
+            case TARGET_IMAGE:
+                for(size_t j = 0; j < imagesLen; j++){
+                    argv[argc] = images[j].path;
+                    argv[argc + 1] = NULL;
+                    runBenchmark(argv, &result, runs);
+                    writeResult(
+                        stdout, mode, images[j].name, &result,
+                        images[j].size, 1
+                    );
+                }
+                break;
+            case TARGET_BATCH:
+                for(size_t j = 0; j < imagesLen; j++)
+                    argv[argc + j] = images[j].path;
+                argv[argc + imagesLen] = NULL;
+                runBenchmark(argv, &result, runs);
+                writeResult(
+                    stdout, mode, "corpus", &result, corpusSize, imagesLen
+                );
+                break;
+            case TARGET_SCAN:
+                argv[argc] = "-l";
+                argv[argc + 1] = listPath;
+                argv[argc + 2] = NULL;
+                runBenchmark(argv, &result, runs);
+                writeResult(
+                    stdout, mode, "list", &result, 0, SCAN_BATCH_SIZE
+                );
+                break;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
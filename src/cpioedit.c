@@ -0,0 +1,844 @@
+/**
+
+MIT License
+
+Copyright (c) 2017 Dylan Hicks (aka. dylanh333)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/sysmacros.h>
+#include <getopt.h>
+
+// Streamed input is read ahead this much at a time
+#define COPY_CHUNK_SIZE (1024 * 1024)
+
+#define CPIO_HEADER_SIZE 110
+#define CPIO_TRAILER "TRAILER!!!"
+#define CPIO_ALIGN(size) (((size) + 3) & ~(uint64_t)3)
+
+// mkbootfs pads the end of the archive out to a multiple of this
+#define CPIO_END_ALIGNMENT 256
+
+#define throwError(message, ...) {\
+    fprintf(stderr, "Error in %s(): " message "\n", __func__, ##__VA_ARGS__);\
+    exit(EXIT_FAILURE);\
+}
+
+#define throwWarning(message, ...) \
+    fprintf(stderr, "Warning in %s(): " message "\n", __func__, ##__VA_ARGS__);
+
+// The fields of a newc header, after its six character magic
+enum cpioField {
+    CPIO_INO, CPIO_MODE, CPIO_UID, CPIO_GID, CPIO_NLINK, CPIO_MTIME,
+    CPIO_FILESIZE, CPIO_DEVMAJOR, CPIO_DEVMINOR, CPIO_RDEVMAJOR,
+    CPIO_RDEVMINOR, CPIO_NAMESIZE, CPIO_CHECK, CPIO_FIELDS
+};
+
+typedef struct {
+    uint8_t header[CPIO_HEADER_SIZE];
+    uint32_t fields[CPIO_FIELDS];
+    char *name;             // followed by its padding, as read
+    size_t nameSize;        // bytes allocated for name
+    size_t nameLen;         // the name and its padding
+    off_t offset;           // of the header in the input
+} cpioEntry;
+
+typedef struct {
+    const char *path;       // within the archive
+    const char *src;        // what to add or replace it with
+    uint32_t mode;          // permissions to chmod it to
+    bool done;
+} cpioEdit;
+
+typedef struct {
+    cpioEdit *items;
+    size_t len, size;
+} cpioEdits;
+
+typedef struct {
+    int inFd;
+    bool seekable;          // whether unchanged input can be copied in-kernel
+    off_t inOffset;         // of the next byte of input
+    off_t copyFrom;         // start of the unchanged input not yet copied
+    uint8_t *buffer;        // read-ahead, for streamed input
+    size_t bufferLen, bufferPos;
+
+    int outFd;
+    bool dryRun;            // only check that the edits apply
+    uint64_t outSize;
+
+    cpioEdits adds, replaces, deletes, chmods;
+    size_t nextAdd;         // adds are written out in archive order
+    char **dirs;            // directories written so far
+    size_t dirsLen, dirsSize;
+    bool prescanned;        // whether maxIno covers the whole archive
+    uint32_t maxIno;        // highest inode in the archive read so far
+    uint32_t nextIno;       // for the next added entry
+} cpioEditor;
+
+/**
+ * Compares two paths by the order mkbootfs archives them in, which is
+ * depth-first, with each directory's entries sorted by name.
+ */
+int comparePaths(const char *a, const char *b){
+    for(;;){
+        size_t aLen = strcspn(a, "/"), bLen = strcspn(b, "/");
+        int cmp = memcmp(a, b, aLen < bLen ? aLen : bLen);
+
+        if(cmp) return cmp;
+        if(aLen != bLen) return aLen < bLen ? -1 : 1;
+        a += aLen;
+        b += bLen;
+        if(!*a || !*b) return *a ? 1 : *b ? -1 : 0;
+        a++;
+        b++;
+    }
+}
+
+int compareEdits(const void *a, const void *b){
+    return strcmp(((const cpioEdit*)a)->path, ((const cpioEdit*)b)->path);
+}
+
+int compareAdds(const void *a, const void *b){
+    return comparePaths(
+        ((const cpioEdit*)a)->path, ((const cpioEdit*)b)->path
+    );
+}
+
+cpioEdit *findEdit(cpioEdits *edits, const char *path){
+    cpioEdit key = { .path = path };
+
+    if(!edits->len) return NULL;
+    return bsearch(
+        &key, edits->items, edits->len, sizeof(cpioEdit), compareEdits
+    );
+}
+
+/**
+ * Adds an edit to path, as given on the command line, less any leading '/'.
+ */
+cpioEdit *pushEdit(cpioEdits *edits, const char *path){
+    cpioEdit *edit;
+
+    while(*path == '/') path++;
+    if(!*path) throwError("Can't edit the archive's root");
+
+    if(edits->len == edits->size){
+        edits->size = edits->size ? edits->size * 2 : 16;
+        edits->items = realloc(edits->items, edits->size * sizeof(cpioEdit));
+        if(!edits->items) throwError("Failed to allocate edits");
+    }
+    edit = &edits->items[edits->len++];
+    memset(edit, 0, sizeof(*edit));
+    edit->path = path;
+    return edit;
+}
+
+/**
+ * Splits a "path=value" option argument in place, returning the value.
+ */
+char *splitArg(char *arg, const char *option){
+    char *value = strchr(arg, '=');
+
+    if(!value || value == arg || !value[1]) throwError(
+        "Expected --%s <path>=<value>, got \"%s\"", option, arg
+    );
+    *value = '\0';
+    return value + 1;
+}
+
+void writeOutput(cpioEditor *ed, const void *data, size_t size){
+    size_t written = 0;
+
+    ed->outSize += size;
+    if(ed->dryRun) return;
+
+    while(written < size){
+        ssize_t ret = write(
+            ed->outFd, (const uint8_t*)data + written, size - written
+        );
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            throwError("Failed to write output. %s", strerror(errno));
+        }
+        written += ret;
+    }
+}
+
+void writePadding(cpioEditor *ed, unsigned alignment){
+    static const uint8_t zeros[CPIO_END_ALIGNMENT];
+
+    if(ed->outSize % alignment) writeOutput(
+        ed, zeros, alignment - ed->outSize % alignment
+    );
+}
+
+/**
+ * Copies size bytes at offset in srcFd to the output, in the kernel with
+ * copy_file_range() or sendfile() where possible, and through a buffer
+ * otherwise.
+ */
+void copyToOutput(cpioEditor *ed, int srcFd, off_t offset, uint64_t size){
+    static bool noCopyRange = false, noSendfile = false;
+    static uint8_t buffer[COPY_CHUNK_SIZE];
+
+    if(ed->dryRun){
+        ed->outSize += size;
+        return;
+    }
+
+    while(size > 0){
+        size_t chunk = size < SSIZE_MAX ? size : SSIZE_MAX;
+        loff_t inOffset = offset;
+        ssize_t ret = -1;
+
+        if(!noCopyRange){
+            ret = copy_file_range(srcFd, &inOffset, ed->outFd, NULL, chunk, 0);
+            if(ret < 0 && errno != EINTR) noCopyRange = true;
+        }else if(!noSendfile){
+            ret = sendfile(ed->outFd, srcFd, &inOffset, chunk);
+            if(ret < 0 && errno != EINTR) noSendfile = true;
+        }else{
+            if(chunk > COPY_CHUNK_SIZE) chunk = COPY_CHUNK_SIZE;
+            ret = pread(srcFd, buffer, chunk, offset);
+            if(ret < 0 && errno != EINTR) throwError(
+                "Failed to read input. %s", strerror(errno)
+            );
+            if(ret > 0) writeOutput(ed, buffer, ret);
+        }
+        if(ret == 0) throwError("Input ended while being copied");
+        if(ret > 0){
+            if(noSendfile) ed->outSize -= ret; // writeOutput() counted it
+            ed->outSize += ret;
+            offset += ret;
+            size -= ret;
+        }
+    }
+}
+
+/**
+ * Copies whatever input is left unchanged before offset to the output, for
+ * seekable input, which is copied in runs between edits rather than entry
+ * by entry.
+ */
+void flushInput(cpioEditor *ed, off_t offset){
+    if(!ed->seekable) return;
+    if(offset > ed->copyFrom) copyToOutput(
+        ed, ed->inFd, ed->copyFrom, offset - ed->copyFrom
+    );
+    ed->copyFrom = offset;
+}
+
+/**
+ * Reads size bytes of streamed input into data, or skips them if data is
+ * NULL, or copies them to the output if pass is set.
+ */
+void streamInput(cpioEditor *ed, void *data, uint64_t size, bool pass){
+    while(size > 0){
+        size_t chunk = ed->bufferLen - ed->bufferPos;
+
+        if(!chunk){
+            ssize_t ret = read(ed->inFd, ed->buffer, COPY_CHUNK_SIZE);
+            if(ret < 0){
+                if(errno == EINTR) continue;
+                throwError("Failed to read input. %s", strerror(errno));
+            }
+            if(ret == 0) throwError(
+                "Archive ends abruptly at offset %lld", (long long)ed->inOffset
+            );
+            ed->bufferLen = ret;
+            ed->bufferPos = 0;
+            continue;
+        }
+
+        if(chunk > size) chunk = size;
+        if(data){
+            memcpy(data, ed->buffer + ed->bufferPos, chunk);
+            data = (uint8_t*)data + chunk;
+        }
+        if(pass) writeOutput(ed, ed->buffer + ed->bufferPos, chunk);
+        ed->bufferPos += chunk;
+        ed->inOffset += chunk;
+        size -= chunk;
+    }
+}
+
+void readInput(cpioEditor *ed, void *data, size_t size){
+    size_t done = 0;
+
+    if(!ed->seekable){
+        streamInput(ed, data, size, false);
+        return;
+    }
+
+    while(done < size){
+        ssize_t ret = pread(
+            ed->inFd, (uint8_t*)data + done, size - done, ed->inOffset + done
+        );
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            throwError("Failed to read input. %s", strerror(errno));
+        }
+        if(ret == 0) throwError(
+            "Archive ends abruptly at offset %lld",
+            (long long)(ed->inOffset + done)
+        );
+        done += ret;
+    }
+    ed->inOffset += size;
+}
+
+/**
+ * Moves past size bytes of input, either leaving them to be copied to the
+ * output, or if skip is set, dropping them.
+ */
+void passInput(cpioEditor *ed, uint64_t size, bool skip){
+    if(!ed->seekable) streamInput(ed, NULL, size, !skip);
+    else ed->inOffset += size;
+    if(skip) ed->copyFrom = ed->inOffset;
+}
+
+/**
+ * Reads up to size bytes of input into data.
+ * Returns how many were read, which is only 0 at the end of the input.
+ */
+size_t readSome(cpioEditor *ed, void *data, size_t size){
+    ssize_t ret;
+
+    if(!ed->seekable && ed->bufferPos < ed->bufferLen){
+        if(size > ed->bufferLen - ed->bufferPos)
+            size = ed->bufferLen - ed->bufferPos;
+        memcpy(data, ed->buffer + ed->bufferPos, size);
+        ed->bufferPos += size;
+        ed->inOffset += size;
+        return size;
+    }
+
+    do{
+        ret = ed->seekable ? pread(ed->inFd, data, size, ed->inOffset)
+            : read(ed->inFd, data, size);
+    }while(ret < 0 && errno == EINTR);
+    if(ret < 0) throwError("Failed to read input. %s", strerror(errno));
+    ed->inOffset += ret;
+    return ret;
+}
+
+/**
+ * Copies whatever follows the trailer's padding (eg. another archive that
+ * was appended to this one) to the output unedited, rather than dropping it.
+ * It starts from the 4 byte boundary that the next header would have to be
+ * on, and the trailer has just been padded to a larger one.
+ */
+void passTrailing(cpioEditor *ed){
+    uint8_t data[COPY_CHUNK_SIZE / 16];
+    uint64_t kept = 0;
+    off_t start = -1;
+    size_t len;
+
+    while((len = readSome(ed, data, sizeof(data)))){
+        size_t pos = 0;
+        off_t chunkOffset = ed->inOffset - len;
+
+        if(start < 0){
+            while(pos < len && !data[pos]) pos++;
+            if(pos == len) continue;
+            start = (chunkOffset + pos) & ~(off_t)3;
+            if(start < chunkOffset) start = chunkOffset;
+            pos = start - chunkOffset;
+        }
+        writeOutput(ed, data + pos, len - pos);
+        kept += len - pos;
+    }
+    if(kept && !ed->dryRun) throwWarning(
+        "Kept %llu bytes after the trailer unedited", (unsigned long long)kept
+    );
+}
+
+void readEntry(cpioEditor *ed, cpioEntry *entry){
+    char digits[9] = {0};
+
+    entry->offset = ed->inOffset;
+    readInput(ed, entry->header, CPIO_HEADER_SIZE);
+    if(memcmp(entry->header, "070701", 6)
+        && memcmp(entry->header, "070702", 6)
+    ) throwError(
+        "No newc header at offset %lld", (long long)entry->offset
+    );
+
+    for(int i = 0; i < CPIO_FIELDS; i++){
+        char *end;
+
+        memcpy(digits, entry->header + 6 + i * 8, 8);
+        entry->fields[i] = strtoul(digits, &end, 16);
+        if(*end) throwError(
+            "Invalid newc header at offset %lld", (long long)entry->offset
+        );
+    }
+
+    entry->nameLen = CPIO_ALIGN(CPIO_HEADER_SIZE
+        + entry->fields[CPIO_NAMESIZE]) - CPIO_HEADER_SIZE;
+    if(entry->nameLen > entry->nameSize){
+        entry->nameSize = entry->nameLen;
+        entry->name = realloc(entry->name, entry->nameSize);
+        if(!entry->name) throwError("Failed to allocate entry name");
+    }
+    readInput(ed, entry->name, entry->nameLen);
+    if(!entry->fields[CPIO_NAMESIZE]
+        || entry->name[entry->fields[CPIO_NAMESIZE] - 1]
+    ) throwError(
+        "Invalid name at offset %lld", (long long)entry->offset
+    );
+
+    if(entry->fields[CPIO_INO] > ed->maxIno)
+        ed->maxIno = entry->fields[CPIO_INO];
+    if(!ed->prescanned && !ed->dryRun && ed->nextIno < UINT32_MAX
+        && entry->fields[CPIO_INO] > ed->nextIno
+    ) throwWarning(
+        "\"%s\" may share its inode with an added entry", entry->name
+    );
+}
+
+/**
+ * Writes a header with the given fields, followed by name and its padding.
+ * The magic is taken from the entry being edited, if any, so that a crc
+ * format entry whose contents haven't changed stays one.
+ */
+void writeHeader(
+    cpioEditor *ed, const cpioEntry *entry, const uint32_t *fields,
+    const char *name
+){
+    char header[CPIO_HEADER_SIZE + 1];
+    size_t nameSize = strlen(name) + 1;
+    static const uint8_t zeros[4];
+
+    memcpy(header, entry ? (const char*)entry->header : "070701", 6);
+    for(int i = 0; i < CPIO_FIELDS; i++)
+        snprintf(header + 6 + i * 8, 9, "%08x", fields[i]);
+    writeOutput(ed, header, CPIO_HEADER_SIZE);
+    writeOutput(ed, name, nameSize);
+    writeOutput(ed, zeros, CPIO_ALIGN(CPIO_HEADER_SIZE + nameSize)
+        - CPIO_HEADER_SIZE - nameSize);
+}
+
+/**
+ * Writes size bytes of the file at path to the output, followed by padding.
+ */
+void writeFileData(cpioEditor *ed, const char *path, uint32_t size){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0) throwError("Failed to open \"%s\". %s", path, strerror(errno));
+    copyToOutput(ed, fd, 0, size);
+    writePadding(ed, 4);
+    close(fd);
+}
+
+void rememberDir(cpioEditor *ed, const char *path){
+    if(ed->dirsLen == ed->dirsSize){
+        ed->dirsSize = ed->dirsSize ? ed->dirsSize * 2 : 64;
+        ed->dirs = realloc(ed->dirs, ed->dirsSize * sizeof(char*));
+        if(!ed->dirs) throwError("Failed to allocate directory list");
+    }
+    if(!(ed->dirs[ed->dirsLen++] = strdup(path)))
+        throwError("Failed to allocate directory list");
+}
+
+bool hasParent(cpioEditor *ed, const char *path){
+    const char *slash = strrchr(path, '/');
+
+    if(!slash) return true;
+    for(size_t i = 0; i < ed->dirsLen; i++){
+        if(strlen(ed->dirs[i]) == (size_t)(slash - path)
+            && !memcmp(ed->dirs[i], path, slash - path)
+        ) return true;
+    }
+    return false;
+}
+
+/**
+ * Writes out a new entry for an added path, from whatever's at its source.
+ */
+void writeAdd(cpioEditor *ed, cpioEdit *add){
+    uint32_t fields[CPIO_FIELDS] = {0};
+    cpioEdit *chmod = findEdit(&ed->chmods, add->path);
+    char target[4096];
+    struct stat st;
+
+    if(lstat(add->src, &st)) throwError(
+        "Failed to stat \"%s\". %s", add->src, strerror(errno)
+    );
+    if(!hasParent(ed, add->path)) throwError(
+        "Can't add \"%s\", as its directory isn't in the archive", add->path
+    );
+
+    // Added entries are numbered after every inode in the archive if it's
+    // been prescanned, or else down from the top, out of mkbootfs's way
+    fields[CPIO_INO] = ed->prescanned ? ed->nextIno++ : ed->nextIno--;
+    fields[CPIO_MODE] = st.st_mode;
+    fields[CPIO_NLINK] = 1;
+    fields[CPIO_NAMESIZE] = strlen(add->path) + 1;
+    if(S_ISREG(st.st_mode)){
+        if(st.st_size > UINT32_MAX) throwError(
+            "\"%s\" is over 4GiB", add->src
+        );
+        fields[CPIO_FILESIZE] = st.st_size;
+    }else if(S_ISLNK(st.st_mode)){
+        ssize_t len = readlink(add->src, target, sizeof(target));
+        if(len < 0 || len == sizeof(target)) throwError(
+            "Failed to read link \"%s\". %s", add->src, strerror(errno)
+        );
+        fields[CPIO_FILESIZE] = len;
+    }else if(S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)){
+        fields[CPIO_RDEVMAJOR] = major(st.st_rdev);
+        fields[CPIO_RDEVMINOR] = minor(st.st_rdev);
+    }
+    if(chmod){
+        fields[CPIO_MODE] = (fields[CPIO_MODE] & ~07777) | chmod->mode;
+        chmod->done = true;
+    }
+
+    writeHeader(ed, NULL, fields, add->path);
+    if(S_ISREG(st.st_mode)){
+        writeFileData(ed, add->src, fields[CPIO_FILESIZE]);
+    }else if(S_ISLNK(st.st_mode)){
+        writeOutput(ed, target, fields[CPIO_FILESIZE]);
+        writePadding(ed, 4);
+    }
+    if(S_ISDIR(st.st_mode)) rememberDir(ed, add->path);
+    add->done = true;
+}
+
+/**
+ * Returns whether path, or any directory it's in, is to be deleted.
+ */
+bool isDeleted(cpioEditor *ed, const char *path){
+    char prefix[4096];
+    cpioEdit *edit;
+
+    if((edit = findEdit(&ed->deletes, path))){
+        edit->done = true;
+        return true;
+    }
+    for(const char *slash = path; (slash = strchr(slash, '/')); slash++){
+        if((size_t)(slash - path) >= sizeof(prefix)) break;
+        memcpy(prefix, path, slash - path);
+        prefix[slash - path] = '\0';
+        if(findEdit(&ed->deletes, prefix)) return true;
+    }
+    return false;
+}
+
+/**
+ * Writes out entry with its contents replaced by those of replace->src, or
+ * for a symlink, with replace->src as its new target.
+ */
+void writeReplace(
+    cpioEditor *ed, cpioEntry *entry, cpioEdit *replace, cpioEdit *chmod
+){
+    uint32_t fields[CPIO_FIELDS];
+    uint32_t mode = entry->fields[CPIO_MODE];
+    struct stat st;
+
+    memcpy(fields, entry->fields, sizeof(fields));
+    if(chmod) fields[CPIO_MODE] = (mode & ~07777) | chmod->mode;
+
+    if(S_ISLNK(mode)){
+        fields[CPIO_FILESIZE] = strlen(replace->src);
+        fields[CPIO_CHECK] = 0;
+        writeHeader(ed, NULL, fields, entry->name);
+        writeOutput(ed, replace->src, fields[CPIO_FILESIZE]);
+        writePadding(ed, 4);
+        return;
+    }
+
+    if(!S_ISREG(mode)) throwError(
+        "Can only replace files and symlinks, which \"%s\" isn't",
+        entry->name
+    );
+    if(entry->fields[CPIO_NLINK] > 1) throwError(
+        "Can't replace \"%s\", as it's hard linked", entry->name
+    );
+    if(stat(replace->src, &st)) throwError(
+        "Failed to stat \"%s\". %s", replace->src, strerror(errno)
+    );
+    if(!S_ISREG(st.st_mode)) throwError(
+        "\"%s\" isn't a regular file", replace->src
+    );
+    if(st.st_size > UINT32_MAX) throwError(
+        "\"%s\" is over 4GiB", replace->src
+    );
+
+    fields[CPIO_FILESIZE] = st.st_size;
+    fields[CPIO_CHECK] = 0;
+    writeHeader(ed, NULL, fields, entry->name);
+    writeFileData(ed, replace->src, fields[CPIO_FILESIZE]);
+}
+
+/**
+ * Makes one pass over the archive, applying the edits as it goes. Entries
+ * that aren't edited are streamed straight through, and for seekable input,
+ * copied in-kernel in runs between edits, so that the work done depends on
+ * the size of the edits, rather than of the archive.
+ */
+void editArchive(cpioEditor *ed){
+    cpioEntry entry = {0};
+
+    ed->inOffset = ed->copyFrom = 0;
+    ed->bufferLen = ed->bufferPos = 0;
+    ed->outSize = 0;
+    ed->nextAdd = 0;
+    ed->nextIno = ed->prescanned ? ed->maxIno + 1 : UINT32_MAX;
+    for(size_t i = 0; i < ed->dirsLen; i++) free(ed->dirs[i]);
+    ed->dirsLen = 0;
+    cpioEdits *all[] = { &ed->adds, &ed->replaces, &ed->deletes, &ed->chmods };
+    for(size_t i = 0; i < sizeof(all) / sizeof(*all); i++)
+        for(size_t j = 0; j < all[i]->len; j++) all[i]->items[j].done = false;
+
+    for(;;){
+        bool trailer;
+        uint64_t dataLen;
+        cpioEdit *replace, *chmod;
+
+        readEntry(ed, &entry);
+        trailer = !strcmp(entry.name, CPIO_TRAILER);
+        dataLen = CPIO_ALIGN(entry.fields[CPIO_FILESIZE]);
+
+        // Anything added goes in just before the first entry that sorts
+        // after it, or the trailer
+        while(ed->nextAdd < ed->adds.len){
+            cpioEdit *add = &ed->adds.items[ed->nextAdd];
+            int cmp = trailer ? -1 : comparePaths(add->path, entry.name);
+
+            if(cmp > 0) break;
+            if(cmp == 0) throwError(
+                "\"%s\" is already in the archive", add->path
+            );
+            flushInput(ed, entry.offset);
+            writeAdd(ed, add);
+            ed->nextAdd++;
+        }
+
+        if(trailer){
+            flushInput(ed, entry.offset);
+            writeOutput(ed, entry.header, CPIO_HEADER_SIZE);
+            writeOutput(ed, entry.name, entry.nameLen);
+            writePadding(ed, CPIO_END_ALIGNMENT);
+            passInput(ed, dataLen, true);
+            passTrailing(ed);
+            break;
+        }
+
+        replace = findEdit(&ed->replaces, entry.name);
+        chmod = findEdit(&ed->chmods, entry.name);
+        if(isDeleted(ed, entry.name)){
+            if(replace || chmod) throwError(
+                "\"%s\" is both edited and deleted", entry.name
+            );
+            flushInput(ed, entry.offset);
+            passInput(ed, dataLen, true);
+            continue;
+        }
+        if(S_ISDIR(entry.fields[CPIO_MODE])) rememberDir(ed, entry.name);
+
+        if(replace){
+            flushInput(ed, entry.offset);
+            writeReplace(ed, &entry, replace, chmod);
+            passInput(ed, dataLen, true);
+            replace->done = true;
+            if(chmod) chmod->done = true;
+        }else if(chmod){
+            uint32_t fields[CPIO_FIELDS];
+
+            memcpy(fields, entry.fields, sizeof(fields));
+            fields[CPIO_MODE] = (fields[CPIO_MODE] & ~07777) | chmod->mode;
+            flushInput(ed, entry.offset);
+            writeHeader(ed, &entry, fields, entry.name);
+            ed->copyFrom = ed->inOffset;
+            passInput(ed, dataLen, false);
+            chmod->done = true;
+        }else{
+            if(!ed->seekable){
+                writeOutput(ed, entry.header, CPIO_HEADER_SIZE);
+                writeOutput(ed, entry.name, entry.nameLen);
+            }
+            passInput(ed, dataLen, false);
+        }
+    }
+
+    free(entry.name);
+
+    cpioEdits *targeted[] = { &ed->replaces, &ed->deletes, &ed->chmods };
+    for(size_t i = 0; i < sizeof(targeted) / sizeof(*targeted); i++)
+    for(size_t j = 0; j < targeted[i]->len; j++){
+        if(!targeted[i]->items[j].done) throwError(
+            "\"%s\" isn't in the archive", targeted[i]->items[j].path
+        );
+    }
+}
+
+void usage(char **args){
+    printf(
+        "Usage: %s [OPTIONS] <archive> [-o <output>]\n\n"
+        "Edits the entries of an uncompressed newc cpio archive (eg. a\n"
+        "ramdisk made by mkbootfs) without unpacking it. Entries that\n"
+        "aren't edited are copied straight through, so the time taken\n"
+        "depends on the size of the edits, rather than of the archive.\n"
+        "The archive can be - to read it from standard input, and the\n"
+        "edited archive is written to standard output without -o.\n\n"
+        "OPTIONS:\n"
+        "\t-a, --add <path>=<file>: Add the file, directory, or symlink\n"
+        "\t\tat <file> to the archive as <path>. It goes where\n"
+        "\t\tmkbootfs would have put it, and its directory must already\n"
+        "\t\tbe in the archive, or be added too.\n"
+        "\t-r, --replace <path>=<file>: Replace the contents of <path>\n"
+        "\t\twith those of <file>, or if <path> is a symlink, point it\n"
+        "\t\tat <file> instead.\n"
+        "\t-d, --delete <path>: Delete <path>, and everything in it if\n"
+        "\t\tit's a directory.\n"
+        "\t-m, --chmod <path>=<mode>: Set the permissions of <path> to\n"
+        "\t\tthe octal <mode>.\n"
+        "\t-o, --output <output>: Write the edited archive here.\n",
+        args[0]
+    );
+}
+
+int main(int argsLen, char **args){
+    const struct option longOpts[] = {
+        { "add", required_argument, NULL, 'a' },
+        { "replace", required_argument, NULL, 'r' },
+        { "delete", required_argument, NULL, 'd' },
+        { "chmod", required_argument, NULL, 'm' },
+        { "output", required_argument, NULL, 'o' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    cpioEditor ed = { .inFd = -1, .outFd = STDOUT_FILENO };
+    const char *input = NULL, *output = NULL;
+    struct stat inStat, outStat;
+    cpioEdit *edit;
+    char *value, *end;
+
+    // Parse supplied arguments
+    int opt = 0;
+    while((opt = getopt_long(argsLen, args, "a:r:d:m:o:h", longOpts, NULL))
+        >= 0
+    ) switch(opt){
+        case 'a':
+            value = splitArg(optarg, "add");
+            pushEdit(&ed.adds, optarg)->src = value;
+            break;
+        case 'r':
+            value = splitArg(optarg, "replace");
+            pushEdit(&ed.replaces, optarg)->src = value;
+            break;
+        case 'd': pushEdit(&ed.deletes, optarg); break;
+        case 'm':
+            value = splitArg(optarg, "chmod");
+            edit = pushEdit(&ed.chmods, optarg);
+            edit->mode = strtoul(value, &end, 8);
+            if(*end || edit->mode > 07777) throwError(
+                "Invalid mode \"%s\"", value
+            );
+            break;
+        case 'o': output = optarg; break;
+        default:
+            usage(args);
+            return EXIT_FAILURE;
+    }
+
+    if(optind != argsLen - 1){
+        usage(args);
+        return EXIT_FAILURE;
+    }
+    input = args[optind];
+
+    // Replaces, deletes and chmods are looked up by path as entries go by,
+    // whereas adds are written out in the order they'd be archived in
+    cpioEdits *byPath[] = { &ed.replaces, &ed.deletes, &ed.chmods };
+    for(size_t i = 0; i < sizeof(byPath) / sizeof(*byPath); i++){
+        qsort(byPath[i]->items, byPath[i]->len, sizeof(cpioEdit),
+            compareEdits);
+        for(size_t j = 1; j < byPath[i]->len; j++)
+            if(!strcmp(byPath[i]->items[j].path, byPath[i]->items[j-1].path))
+                throwError(
+                    "\"%s\" is edited twice", byPath[i]->items[j].path
+                );
+    }
+    qsort(ed.adds.items, ed.adds.len, sizeof(cpioEdit), compareAdds);
+    for(size_t i = 0; i < ed.adds.len; i++){
+        if(i && !strcmp(ed.adds.items[i].path, ed.adds.items[i-1].path))
+            throwError("\"%s\" is added twice", ed.adds.items[i].path);
+        if(findEdit(&ed.replaces, ed.adds.items[i].path)
+            || findEdit(&ed.deletes, ed.adds.items[i].path)
+        ) throwError(
+            "\"%s\" is both added and edited", ed.adds.items[i].path
+        );
+    }
+
+    if(!strcmp(input, "-")) ed.inFd = STDIN_FILENO;
+    else if((ed.inFd = open(input, O_RDONLY | O_CLOEXEC)) < 0) throwError(
+        "Failed to open \"%s\". %s", input, strerror(errno)
+    );
+    if(fstat(ed.inFd, &inStat)) throwError(
+        "Failed to stat \"%s\". %s", input, strerror(errno)
+    );
+    ed.seekable = S_ISREG(inStat.st_mode);
+    if(!ed.seekable && !(ed.buffer = malloc(COPY_CHUNK_SIZE)))
+        throwError("Failed to allocate input buffer");
+
+    // Input that can be read twice is checked first, so that the edits
+    // either all apply, or nothing is written
+    if(ed.seekable){
+        ed.dryRun = true;
+        editArchive(&ed);
+        ed.dryRun = false;
+        ed.prescanned = true;
+    }
+
+    if(output && strcmp(output, "-")){
+        if(!stat(output, &outStat) && outStat.st_dev == inStat.st_dev
+            && outStat.st_ino == inStat.st_ino
+        ) throwError("Can't edit \"%s\" in place", input);
+        ed.outFd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if(ed.outFd < 0) throwError(
+            "Failed to open \"%s\". %s", output, strerror(errno)
+        );
+    }
+
+    editArchive(&ed);
+
+    if(ed.outFd != STDOUT_FILENO && close(ed.outFd)) throwError(
+        "Failed to write \"%s\". %s", output, strerror(errno)
+    );
+    return EXIT_SUCCESS;
+}
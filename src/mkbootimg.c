@@ -0,0 +1,426 @@
+/**
+
+MIT License
+
+Copyright (c) 2017 Dylan Hicks (aka. dylanh333)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+**/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <getopt.h>
+#include "bootimg.h"
+#include "sha1.h"
+
+// Inputs are hashed and copied this much at a time, so that each chunk is
+// still in cache when it gets copied after being hashed
+#define COPY_CHUNK_SIZE (1024 * 1024)
+
+#define throwError(message, ...) {\
+    fprintf(stderr, "Error in %s(): " message "\n", __func__, ##__VA_ARGS__);\
+    exit(EXIT_FAILURE);\
+}
+
+#define throwWarning(message, ...) \
+    fprintf(stderr, "Warning in %s(): " message "\n", __func__, ##__VA_ARGS__);
+
+void writeAt(int destFd, const void *data, size_t byteCount, off_t offset){
+    size_t written = 0;
+
+    while(written < byteCount){
+        ssize_t ret = pwrite(
+            destFd, (const char*)data + written, byteCount - written,
+            offset + written
+        );
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            throwError("Failed to write to output. %s", strerror(errno));
+        }
+        written += ret;
+    }
+}
+
+/**
+ * Copies size bytes of a mapped input to destOffset in destFd, hashing each
+ * chunk just before it's copied. The copy itself is left to the kernel with
+ * copy_file_range() where possible, which can share extents outright on
+ * filesystems that support it.
+ */
+void copyMappedInput(
+    int srcFd, const uint8_t *src, size_t size,
+    int destFd, off_t destOffset, sha1Context *sha
+){
+    bool inKernel = true;
+
+    for(size_t done = 0; done < size;){
+        size_t chunk = size - done < COPY_CHUNK_SIZE
+            ? size - done : COPY_CHUNK_SIZE;
+
+        sha1Update(sha, src + done, chunk);
+
+        for(size_t copied = 0; copied < chunk;){
+            loff_t inOffset = done + copied, outOffset = destOffset + inOffset;
+            ssize_t ret = -1;
+
+            if(inKernel) ret = copy_file_range(
+                srcFd, &inOffset, destFd, &outOffset, chunk - copied, 0
+            );
+            if(ret < 0 && inKernel && errno != EINTR){
+                if(errno != ENOSYS && errno != EXDEV && errno != EINVAL
+                    && errno != EOPNOTSUPP
+                ) throwError("Failed to copy input. %s", strerror(errno));
+                inKernel = false;
+            }
+            if(!inKernel){
+                writeAt(
+                    destFd, src + done + copied, chunk - copied,
+                    destOffset + done + copied
+                );
+                ret = chunk - copied;
+            }
+            if(ret == 0) throwError("Input shrank while being copied");
+            if(ret > 0) copied += ret;
+        }
+
+        done += chunk;
+    }
+}
+
+/**
+ * Copies an input that can't be mapped (eg. a pipe) to destOffset in destFd,
+ * hashing it on the way through.
+ * Returns its size, which isn't known until it's been read.
+ */
+size_t copyStreamedInput(
+    int srcFd, int destFd, off_t destOffset, sha1Context *sha
+){
+    static uint8_t buffer[COPY_CHUNK_SIZE];
+    size_t size = 0;
+    ssize_t ret;
+
+    while((ret = read(srcFd, buffer, COPY_CHUNK_SIZE)) != 0){
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            throwError("Failed to read input. %s", strerror(errno));
+        }
+        sha1Update(sha, buffer, ret);
+        writeAt(destFd, buffer, ret, destOffset + size);
+        size += ret;
+    }
+
+    return size;
+}
+
+/**
+ * Copies the input at path (if any) to destOffset in destFd, then adds it
+ * and its size to sha the way mkbootimg's update_sha() does, in one pass.
+ * Returns its size.
+ */
+uint32_t writeInput(
+    const char *path, int destFd, off_t destOffset, sha1Context *sha
+){
+    struct stat srcStat;
+    size_t size = 0;
+    uint8_t sizeBytes[4];
+    int srcFd;
+
+    if(path){
+        if((srcFd = open(path, O_RDONLY | O_CLOEXEC)) < 0) throwError(
+            "Failed to open \"%s\". %s", path, strerror(errno)
+        );
+        if(fstat(srcFd, &srcStat)) throwError(
+            "Failed to stat \"%s\". %s", path, strerror(errno)
+        );
+
+        if(S_ISREG(srcStat.st_mode) && srcStat.st_size > 0){
+            const uint8_t *src;
+
+            size = srcStat.st_size;
+            src = mmap(NULL, size, PROT_READ, MAP_SHARED, srcFd, 0);
+            if(src == MAP_FAILED) throwError(
+                "Failed to map \"%s\". %s", path, strerror(errno)
+            );
+            madvise((void*)src, size, MADV_SEQUENTIAL);
+            copyMappedInput(srcFd, src, size, destFd, destOffset, sha);
+            munmap((void*)src, size);
+        }else size = copyStreamedInput(srcFd, destFd, destOffset, sha);
+
+        close(srcFd);
+        if(size > UINT32_MAX) throwError("\"%s\" is over 4GiB", path);
+    }
+
+    // The size goes in as a little-endian 32 bit word, even without a file
+    for(int i = 0; i < 4; i++) sizeBytes[i] = size >> (i * 8);
+    sha1Update(sha, sizeBytes, sizeof(sizeBytes));
+
+    return size;
+}
+
+/**
+ * Parses between minDigits and maxDigits decimal digits at *arg into value,
+ * moving *arg past them. Unlike scanf(), no sign or whitespace is allowed.
+ * Returns false, leaving *arg where it was, if there aren't enough digits.
+ */
+bool parseDigits(
+    const char **arg, int minDigits, int maxDigits, unsigned *value
+){
+    int digits = 0;
+    unsigned parsed = 0;
+
+    while(digits < maxDigits && (*arg)[digits] >= '0'
+        && (*arg)[digits] <= '9'
+    ) parsed = parsed * 10 + ((*arg)[digits++] - '0');
+    if(digits < minDigits) return false;
+    *arg += digits;
+    *value = parsed;
+    return true;
+}
+
+/**
+ * Parses an os_version the way mkbootimg.py does, as whatever matches
+ * ^(\d{1,3})(?:\.(\d{1,3})(?:\.(\d{1,3}))?)?, or 0 if nothing does.
+ */
+uint32_t parseOsVersion(const char *arg){
+    const char *next = arg;
+    unsigned a = 0, b = 0, c = 0;
+
+    if(!parseDigits(&next, 1, 3, &a)) return 0;
+    if(*next == '.'){
+        next++;
+        if(parseDigits(&next, 1, 3, &b) && *next == '.'){
+            next++;
+            parseDigits(&next, 1, 3, &c);
+        }
+    }
+    if(a > 127 || b > 127 || c > 127) throwError(
+        "Invalid os_version \"%s\"", arg
+    );
+    return a << 14 | b << 7 | c;
+}
+
+/**
+ * Parses an os_patch_level the way mkbootimg.py does, as whatever matches
+ * ^(\d{4})-(\d{2})-(\d{2}), or 0 if nothing does.
+ */
+uint32_t parseOsPatchLevel(const char *arg){
+    const char *next = arg;
+    unsigned y = 0, m = 0, d = 0;
+
+    if(!parseDigits(&next, 4, 4, &y) || *next++ != '-'
+        || !parseDigits(&next, 2, 2, &m) || *next++ != '-'
+        || !parseDigits(&next, 2, 2, &d)
+    ) return 0;
+    if(y < 2000 || y > 2127 || m < 1 || m > 12) throwError(
+        "Invalid os_patch_level \"%s\"", arg
+    );
+    return (y - 2000) << 4 | m;
+}
+
+uint32_t parseInt(const char *arg, const char *name){
+    char *end;
+    unsigned long value;
+
+    errno = 0;
+    value = strtoul(arg, &end, 0);
+    if(errno || *end != '\0' || value > UINT32_MAX) throwError(
+        "Invalid %s \"%s\"", name, arg
+    );
+    return value;
+}
+
+void usage(char **args){
+    printf(
+        "Usage: %s --kernel <kernel> --output <output> [OPTIONS]\n\n"
+        "Creates an Android boot image from the provided kernel, ramdisk,\n"
+        "and second-stage bootloader. This takes the same options as the\n"
+        "Python mkbootimg, but streams each input straight into the output\n"
+        "while computing the image ID over it in the same pass.\n\n"
+        "OPTIONS:\n"
+        "\t--kernel <kernel>: Path to the kernel.\n"
+        "\t--ramdisk <ramdisk>: Path to the ramdisk.\n"
+        "\t--second <second>: Path to the second-stage bootloader.\n"
+        "\t--cmdline <cmdline>: Kernel command line (up to 1536 bytes).\n"
+        "\t--base <addr>: Base address (default 0x10000000).\n"
+        "\t--kernel_offset <offset>: Kernel offset (default 0x00008000).\n"
+        "\t--ramdisk_offset <offset>: Ramdisk offset (default 0x01000000).\n"
+        "\t--second_offset <offset>: Second offset (default 0x00f00000).\n"
+        "\t--tags_offset <offset>: Tags offset (default 0x00000100).\n"
+        "\t--os_version <A.B.C>: Operating system version.\n"
+        "\t--os_patch_level <YYYY-MM-DD>: Operating system patch level.\n"
+        "\t--board <name>: Board name (up to 16 bytes).\n"
+        "\t--pagesize <size>: Page size, from 2048 to 16384 (default 2048).\n"
+        "\t--id: Print the image ID on standard output.\n"
+        "\t-o, --output <output>: Write the boot image here.\n",
+        args[0]
+    );
+}
+
+int main(int argsLen, char **args){
+    enum {
+        OPT_KERNEL = 256, OPT_RAMDISK, OPT_SECOND, OPT_CMDLINE, OPT_BASE,
+        OPT_KERNEL_OFFSET, OPT_RAMDISK_OFFSET, OPT_SECOND_OFFSET,
+        OPT_OS_VERSION, OPT_OS_PATCH_LEVEL, OPT_TAGS_OFFSET, OPT_BOARD,
+        OPT_PAGESIZE, OPT_ID
+    };
+    const struct option longOpts[] = {
+        { "kernel", required_argument, NULL, OPT_KERNEL },
+        { "ramdisk", required_argument, NULL, OPT_RAMDISK },
+        { "second", required_argument, NULL, OPT_SECOND },
+        { "cmdline", required_argument, NULL, OPT_CMDLINE },
+        { "base", required_argument, NULL, OPT_BASE },
+        { "kernel_offset", required_argument, NULL, OPT_KERNEL_OFFSET },
+        { "ramdisk_offset", required_argument, NULL, OPT_RAMDISK_OFFSET },
+        { "second_offset", required_argument, NULL, OPT_SECOND_OFFSET },
+        { "os_version", required_argument, NULL, OPT_OS_VERSION },
+        { "os_patch_level", required_argument, NULL, OPT_OS_PATCH_LEVEL },
+        { "tags_offset", required_argument, NULL, OPT_TAGS_OFFSET },
+        { "board", required_argument, NULL, OPT_BOARD },
+        { "pagesize", required_argument, NULL, OPT_PAGESIZE },
+        { "id", no_argument, NULL, OPT_ID },
+        { "output", required_argument, NULL, 'o' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *kernel = NULL, *ramdisk = NULL, *second = NULL;
+    const char *output = NULL, *cmdline = "", *board = "";
+    uint32_t base = 0x10000000, kernelOffset = 0x00008000;
+    uint32_t ramdiskOffset = 0x01000000, secondOffset = 0x00f00000;
+    uint32_t tagsOffset = 0x00000100, pageSize = 2048;
+    uint32_t osVersion = 0, osPatchLevel = 0;
+    bool printId = false;
+    boot_img_hdr header;
+    sha1Context sha;
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    off_t offset;
+    size_t cmdlineLen;
+    int destFd;
+
+    // Parse supplied arguments
+    int opt = 0;
+    while((opt = getopt_long(argsLen, args, "o:h", longOpts, NULL)) >= 0)
+    switch(opt){
+        case OPT_KERNEL: kernel = optarg; break;
+        case OPT_RAMDISK: ramdisk = optarg; break;
+        case OPT_SECOND: second = optarg; break;
+        case OPT_CMDLINE: cmdline = optarg; break;
+        case OPT_BASE: base = parseInt(optarg, "base"); break;
+        case OPT_KERNEL_OFFSET:
+            kernelOffset = parseInt(optarg, "kernel_offset"); break;
+        case OPT_RAMDISK_OFFSET:
+            ramdiskOffset = parseInt(optarg, "ramdisk_offset"); break;
+        case OPT_SECOND_OFFSET:
+            secondOffset = parseInt(optarg, "second_offset"); break;
+        case OPT_OS_VERSION: osVersion = parseOsVersion(optarg); break;
+        case OPT_OS_PATCH_LEVEL:
+            osPatchLevel = parseOsPatchLevel(optarg); break;
+        case OPT_TAGS_OFFSET:
+            tagsOffset = parseInt(optarg, "tags_offset"); break;
+        case OPT_BOARD: board = optarg; break;
+        case OPT_PAGESIZE: pageSize = parseInt(optarg, "pagesize"); break;
+        case OPT_ID: printId = true; break;
+        case 'o': output = optarg; break;
+        default:
+            usage(args);
+            return EXIT_FAILURE;
+    }
+
+    if(!kernel || !output || optind < argsLen){
+        usage(args);
+        return EXIT_FAILURE;
+    }
+    if(pageSize < 2048 || pageSize > 16384 || (pageSize & (pageSize - 1)))
+        throwError("Invalid pagesize %u", pageSize);
+    if(strlen(cmdline) > BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE) throwError(
+        "Command line too long: max %u, got %zu",
+        BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE, strlen(cmdline)
+    );
+    if(strlen(board) > BOOT_NAME_SIZE) throwError(
+        "Board name too long: max %u, got %zu", BOOT_NAME_SIZE, strlen(board)
+    );
+
+    destFd = open(output, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(destFd < 0) throwError(
+        "Failed to open \"%s\". %s", output, strerror(errno)
+    );
+
+    // Write each input after the header page, hashing it on the way. Each
+    // input's size is only known once it's been written, so the header is
+    // written last. Page padding is left as a hole, which reads as zeros.
+    memset(&header, 0, sizeof(header));
+    sha1Init(&sha);
+    offset = pageSize;
+    header.kernel_size = writeInput(kernel, destFd, offset, &sha);
+    offset += (header.kernel_size + pageSize - 1) / pageSize * pageSize;
+    header.ramdisk_size = writeInput(ramdisk, destFd, offset, &sha);
+    offset += (header.ramdisk_size + pageSize - 1) / pageSize * pageSize;
+    header.second_size = writeInput(second, destFd, offset, &sha);
+    offset += (header.second_size + pageSize - 1) / pageSize * pageSize;
+    sha1Final(&sha, digest);
+
+    memcpy(header.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+    header.kernel_addr = base + kernelOffset;
+    header.ramdisk_addr = base + ramdiskOffset;
+    header.second_addr = base + secondOffset;
+    header.tags_addr = base + tagsOffset;
+    header.page_size = pageSize;
+    header.os_version = osVersion << 11 | osPatchLevel;
+    strncpy((char*)header.name, board, BOOT_NAME_SIZE);
+    // Whatever doesn't fit in cmdline carries on in extra_cmdline, and
+    // neither has to be terminated if it's full (its length was checked)
+    cmdlineLen = strlen(cmdline);
+    if(cmdlineLen <= BOOT_ARGS_SIZE){
+        memcpy(header.cmdline, cmdline, cmdlineLen);
+    }else{
+        memcpy(header.cmdline, cmdline, BOOT_ARGS_SIZE);
+        memcpy(
+            header.extra_cmdline, cmdline + BOOT_ARGS_SIZE,
+            cmdlineLen - BOOT_ARGS_SIZE
+        );
+    }
+    memcpy(header.id, digest, SHA1_DIGEST_SIZE);
+
+    writeAt(destFd, &header, sizeof(header), 0);
+    if(ftruncate(destFd, offset)) throwError(
+        "Failed to pad \"%s\". %s", output, strerror(errno)
+    );
+    if(close(destFd)) throwError(
+        "Failed to write \"%s\". %s", output, strerror(errno)
+    );
+
+    if(printId){
+        const uint8_t *id = (const uint8_t*)header.id;
+
+        printf("0x");
+        for(size_t i = 0; i < sizeof(header.id); i++) printf("%02x", id[i]);
+        printf("\n");
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,291 @@
+/**
+
+MIT License
+
+Copyright (c) 2017 Dylan Hicks (aka. dylanh333)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+**/
+
+#include <stdbool.h>
+#include <string.h>
+#include "sha1.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA1_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define SHA1_ARM 1
+#endif
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+typedef void (*sha1BlocksFunc)(uint32_t[5], const uint8_t*, size_t);
+
+/**
+ * Hashes blockCount consecutive 64 byte blocks into state. This is the
+ * portable version, for CPUs without SHA instructions.
+ */
+void sha1BlocksPortable(
+    uint32_t state[5], const uint8_t *blocks, size_t blockCount
+){
+    for(; blockCount; blockCount--, blocks += SHA1_BLOCK_SIZE){
+        uint32_t w[80];
+        uint32_t a = state[0], b = state[1], c = state[2];
+        uint32_t d = state[3], e = state[4];
+
+        for(int i = 0; i < 16; i++) w[i] =
+            (uint32_t)blocks[i * 4] << 24 | (uint32_t)blocks[i * 4 + 1] << 16
+            | (uint32_t)blocks[i * 4 + 2] << 8 | blocks[i * 4 + 3];
+        for(int i = 16; i < 80; i++)
+            w[i] = ROTL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        for(int i = 0; i < 80; i++){
+            uint32_t f, k, temp;
+
+            if(i < 20){ f = (b & c) | (~b & d); k = 0x5a827999; }
+            else if(i < 40){ f = b ^ c ^ d; k = 0x6ed9eba1; }
+            else if(i < 60){ f = (b & c) | (b & d) | (c & d); k = 0x8f1bbcdc; }
+            else{ f = b ^ c ^ d; k = 0xca62c1d6; }
+
+            temp = ROTL(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = ROTL(b, 30); b = a; a = temp;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c;
+        state[3] += d; state[4] += e;
+    }
+}
+
+#ifdef SHA1_X86
+/**
+ * Hashes blocks using the x86 SHA extensions. Each group of 4 rounds uses the
+ * next 4 message words, while the schedule for later groups is computed
+ * alongside it.
+ */
+__attribute__((target("sha,sse4.1")))
+void sha1BlocksShaNi(
+    uint32_t state[5], const uint8_t *blocks, size_t blockCount
+){
+    const __m128i byteSwap = _mm_set_epi64x(
+        0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL
+    );
+    __m128i abcd, e[2], msg[4], abcdSaved, eSaved;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const void*)state), 0x1b);
+    e[0] = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for(; blockCount; blockCount--, blocks += SHA1_BLOCK_SIZE){
+        abcdSaved = abcd;
+        eSaved = e[0];
+
+        for(int i = 0; i < 4; i++) msg[i] = _mm_shuffle_epi8(
+            _mm_loadu_si128((const void*)(blocks + i * 16)), byteSwap
+        );
+
+        for(int group = 0; group < 20; group++){
+            __m128i *cur = &msg[group % 4], *eCur = &e[group % 2];
+
+            if(group == 0) *eCur = _mm_add_epi32(*eCur, *cur);
+            else *eCur = _mm_sha1nexte_epu32(*eCur, *cur);
+            e[(group + 1) % 2] = abcd;
+
+            // The round function's selector has to be an immediate
+            switch(group / 5){
+                case 0: abcd = _mm_sha1rnds4_epu32(abcd, *eCur, 0); break;
+                case 1: abcd = _mm_sha1rnds4_epu32(abcd, *eCur, 1); break;
+                case 2: abcd = _mm_sha1rnds4_epu32(abcd, *eCur, 2); break;
+                default: abcd = _mm_sha1rnds4_epu32(abcd, *eCur, 3); break;
+            }
+
+            if(group >= 3 && group <= 18) msg[(group + 1) % 4] =
+                _mm_sha1msg2_epu32(msg[(group + 1) % 4], *cur);
+            if(group >= 1 && group <= 16) msg[(group + 3) % 4] =
+                _mm_sha1msg1_epu32(msg[(group + 3) % 4], *cur);
+            if(group >= 2 && group <= 17) msg[(group + 2) % 4] =
+                _mm_xor_si128(msg[(group + 2) % 4], *cur);
+        }
+
+        e[0] = _mm_sha1nexte_epu32(e[0], eSaved);
+        abcd = _mm_add_epi32(abcd, abcdSaved);
+    }
+
+    _mm_storeu_si128((void*)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = _mm_extract_epi32(e[0], 3);
+}
+
+bool haveShaNi(void){
+    unsigned a, b, c, d;
+
+    if(!__get_cpuid(1, &a, &b, &c, &d)) return false;
+    if(!(c & bit_SSSE3) || !(c & bit_SSE4_1)) return false;
+    if(!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+    return b & bit_SHA;
+}
+#endif
+
+#ifdef SHA1_ARM
+/**
+ * Hashes blocks using the ARMv8 crypto extensions. As with the x86 version,
+ * the message schedule for later rounds is computed alongside each group of
+ * 4 rounds.
+ */
+__attribute__((target("+crypto")))
+void sha1BlocksArmv8(
+    uint32_t state[5], const uint8_t *blocks, size_t blockCount
+){
+    const uint32_t k[4] = { 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6 };
+    uint32x4_t abcd, abcdSaved, msg[4], tmp[2];
+    uint32_t e[2], eSaved;
+
+    abcd = vld1q_u32(state);
+    e[0] = state[4];
+
+    for(; blockCount; blockCount--, blocks += SHA1_BLOCK_SIZE){
+        abcdSaved = abcd;
+        eSaved = e[0];
+
+        for(int i = 0; i < 4; i++) msg[i] = vreinterpretq_u32_u8(
+            vrev32q_u8(vld1q_u8(blocks + i * 16))
+        );
+        tmp[0] = vaddq_u32(msg[0], vdupq_n_u32(k[0]));
+        tmp[1] = vaddq_u32(msg[1], vdupq_n_u32(k[0]));
+
+        for(int group = 0; group < 20; group++){
+            uint32_t eCur = e[group % 2];
+
+            e[(group + 1) % 2] = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+            if(group < 5) abcd = vsha1cq_u32(abcd, eCur, tmp[group % 2]);
+            else if(group >= 10 && group < 15)
+                abcd = vsha1mq_u32(abcd, eCur, tmp[group % 2]);
+            else abcd = vsha1pq_u32(abcd, eCur, tmp[group % 2]);
+
+            if(group + 2 < 20) tmp[group % 2] = vaddq_u32(
+                msg[(group + 2) % 4], vdupq_n_u32(k[(group + 2) / 5])
+            );
+            if(group >= 1 && group <= 16) msg[(group + 3) % 4] =
+                vsha1su1q_u32(msg[(group + 3) % 4], msg[(group + 2) % 4]);
+            if(group <= 15) msg[group % 4] = vsha1su0q_u32(
+                msg[group % 4], msg[(group + 1) % 4], msg[(group + 2) % 4]
+            );
+        }
+
+        e[0] += eSaved;
+        abcd = vaddq_u32(abcd, abcdSaved);
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e[0];
+}
+#endif
+
+/**
+ * Picks the fastest way of hashing blocks that this CPU supports.
+ */
+sha1BlocksFunc getSha1Blocks(void){
+    static sha1BlocksFunc blocksFunc = NULL;
+    sha1BlocksFunc func = __atomic_load_n(&blocksFunc, __ATOMIC_RELAXED);
+
+    if(func) return func;
+    func = sha1BlocksPortable;
+#ifdef SHA1_X86
+    if(haveShaNi()) func = sha1BlocksShaNi;
+#endif
+#ifdef SHA1_ARM
+    if(getauxval(AT_HWCAP) & HWCAP_SHA1) func = sha1BlocksArmv8;
+#endif
+    __atomic_store_n(&blocksFunc, func, __ATOMIC_RELAXED);
+    return func;
+}
+
+const char *sha1Implementation(void){
+    sha1BlocksFunc func = getSha1Blocks();
+#ifdef SHA1_X86
+    if(func == sha1BlocksShaNi) return "x86 SHA extensions";
+#endif
+#ifdef SHA1_ARM
+    if(func == sha1BlocksArmv8) return "ARMv8 crypto extensions";
+#endif
+    return func == sha1BlocksPortable ? "portable" : "unknown";
+}
+
+void sha1Init(sha1Context *ctx){
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xc3d2e1f0;
+    ctx->length = 0;
+    ctx->blockLen = 0;
+    ctx->blocks = getSha1Blocks();
+}
+
+void sha1Update(sha1Context *ctx, const void *data, size_t size){
+    const uint8_t *bytes = data;
+
+    ctx->length += size;
+
+    // Top up any partial block left over from last time first
+    if(ctx->blockLen){
+        size_t quota = SHA1_BLOCK_SIZE - ctx->blockLen;
+        if(quota > size) quota = size;
+        memcpy(ctx->block + ctx->blockLen, bytes, quota);
+        ctx->blockLen += quota;
+        bytes += quota;
+        size -= quota;
+        if(ctx->blockLen < SHA1_BLOCK_SIZE) return;
+        ctx->blocks(ctx->state, ctx->block, 1);
+        ctx->blockLen = 0;
+    }
+
+    // Then hash whole blocks straight from data, and keep what's left
+    ctx->blocks(ctx->state, bytes, size / SHA1_BLOCK_SIZE);
+    bytes += size / SHA1_BLOCK_SIZE * SHA1_BLOCK_SIZE;
+    ctx->blockLen = size % SHA1_BLOCK_SIZE;
+    memcpy(ctx->block, bytes, ctx->blockLen);
+}
+
+void sha1Final(sha1Context *ctx, uint8_t digest[SHA1_DIGEST_SIZE]){
+    uint64_t bits = ctx->length * 8;
+
+    // Pad with a 1 bit, then zeros up to the last 8 bytes of a block, which
+    // hold the message length in bits
+    ctx->block[ctx->blockLen++] = 0x80;
+    if(ctx->blockLen > SHA1_BLOCK_SIZE - 8){
+        memset(ctx->block + ctx->blockLen, 0, SHA1_BLOCK_SIZE - ctx->blockLen);
+        ctx->blocks(ctx->state, ctx->block, 1);
+        ctx->blockLen = 0;
+    }
+    memset(ctx->block + ctx->blockLen, 0, SHA1_BLOCK_SIZE - 8 - ctx->blockLen);
+    for(int i = 0; i < 8; i++)
+        ctx->block[SHA1_BLOCK_SIZE - 1 - i] = bits >> (i * 8);
+    ctx->blocks(ctx->state, ctx->block, 1);
+
+    for(int i = 0; i < 5; i++){
+        digest[i * 4] = ctx->state[i] >> 24;
+        digest[i * 4 + 1] = ctx->state[i] >> 16;
+        digest[i * 4 + 2] = ctx->state[i] >> 8;
+        digest[i * 4 + 3] = ctx->state[i];
+    }
+}
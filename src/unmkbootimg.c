@@ -24,6 +24,7 @@ SOFTWARE.
 
 **/
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -34,37 +35,410 @@ SOFTWARE.
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <time.h>
+#include <zlib.h>
+#include <lzma.h>
 #include "bootimg.h"
+#include <sparse/sparse.h>
+#include "sha1.h"
 
 #define BOOT_ID_SIZE (sizeof(uint32_t) * 8)
 
-enum sliceIndex {
-    SLICE_HEADER,
-    SLICE_KERNEL,
-    SLICE_RAMDISK,
-    SLICE_SECOND
+/**
+ * Every header field that any supported header version has, in the order
+ * that they're printed in.
+ */
+enum headerField {
+    FIELD_HEADER_VERSION,
+    FIELD_KERNEL_SIZE,
+    FIELD_KERNEL_ADDR,
+    FIELD_RAMDISK_SIZE,
+    FIELD_RAMDISK_ADDR,
+    FIELD_SECOND_SIZE,
+    FIELD_SECOND_ADDR,
+    FIELD_TAGS_ADDR,
+    FIELD_PAGE_SIZE,
+    FIELD_HEADER_SIZE,
+    FIELD_RECOVERY_DTBO_SIZE,
+    FIELD_RECOVERY_DTBO_OFFSET,
+    FIELD_DTB_SIZE,
+    FIELD_DTB_ADDR,
+    FIELD_SIGNATURE_SIZE,
+    FIELD_VENDOR_RAMDISK_TABLE_SIZE,
+    FIELD_VENDOR_RAMDISK_TABLE_ENTRY_NUM,
+    FIELD_VENDOR_RAMDISK_TABLE_ENTRY_SIZE,
+    FIELD_BOOTCONFIG_SIZE,
+    FIELD_OS_VERSION,
+    FIELD_NAME,
+    FIELD_CMDLINE,
+    FIELD_EXTRA_CMDLINE,
+    FIELD_ID,
+    FIELD_COUNT
+};
+
+enum fieldType {
+    TYPE_NUMBER,
+    TYPE_SIZE,
+    TYPE_ADDR,
+    TYPE_OS_VERSION,
+    TYPE_STRING,
+    TYPE_ID
+};
+
+typedef struct {
+    const char *key; // as named in bootimg.h, and in scan records
+    const char *label; // as named in header information
+    enum fieldType type;
+    // The mkbootimg option that sets this field (or, for a slice's size,
+    // that gives the slice's file), if any, and its vendor_boot equivalent
+    // if that's different
+    const char *scriptArg, *vendorScriptArg;
+} headerFieldInfo;
+
+const headerFieldInfo headerFields[] = { //see headerField
+    { "header_version", "Header version", TYPE_NUMBER,
+        "--header_version", NULL },
+    { "kernel_size", "Kernel size", TYPE_SIZE, "--kernel", NULL },
+    { "kernel_addr", "Kernel load address", TYPE_ADDR,
+        "--kernel_offset", NULL },
+    { "ramdisk_size", "Ramdisk size", TYPE_SIZE,
+        "--ramdisk", "--vendor_ramdisk" },
+    { "ramdisk_addr", "Ramdisk load address", TYPE_ADDR,
+        "--ramdisk_offset", NULL },
+    { "second_size", "Second size", TYPE_SIZE, "--second", NULL },
+    { "second_addr", "Second load address", TYPE_ADDR,
+        "--second_offset", NULL },
+    { "tags_addr", "Tags address", TYPE_ADDR, "--tags_offset", NULL },
+    { "page_size", "Page size", TYPE_SIZE, "--pagesize", NULL },
+    { "header_size", "Header size", TYPE_SIZE, NULL, NULL },
+    { "recovery_dtbo_size", "Recovery DTBO size", TYPE_SIZE,
+        "--recovery_dtbo", NULL },
+    { "recovery_dtbo_offset", "Recovery DTBO offset", TYPE_ADDR, NULL, NULL },
+    { "dtb_size", "DTB size", TYPE_SIZE, "--dtb", NULL },
+    { "dtb_addr", "DTB load address", TYPE_ADDR, "--dtb_offset", NULL },
+    { "signature_size", "Boot signature size", TYPE_SIZE, NULL, NULL },
+    { "vendor_ramdisk_table_size", "Vendor ramdisk table size", TYPE_SIZE,
+        NULL, NULL },
+    { "vendor_ramdisk_table_entry_num", "Vendor ramdisk table entries",
+        TYPE_NUMBER, NULL, NULL },
+    { "vendor_ramdisk_table_entry_size", "Vendor ramdisk table entry size",
+        TYPE_SIZE, NULL, NULL },
+    { "bootconfig_size", "Bootconfig size", TYPE_SIZE,
+        "--vendor_bootconfig", NULL },
+    { "os_version", "Android version", TYPE_OS_VERSION, "--os_version", NULL },
+    { "name", "Product name", TYPE_STRING, "--board", NULL },
+    { "cmdline", "Command line", TYPE_STRING,
+        "--cmdline", "--vendor_cmdline" },
+    { "extra_cmdline", "Extra command line", TYPE_STRING, NULL, NULL },
+    { "id", "Image ID (eg. checksum)", TYPE_ID, NULL, NULL }
+};
+
+/**
+ * Where a field is within a particular version of the header. A size of 0
+ * means that version doesn't have the field.
+ */
+typedef struct {
+    uint16_t offset, size;
+} fieldLayout;
+
+#define FIELD(type, member) \
+    { offsetof(type, member), sizeof(((type*)NULL)->member) }
+
+/**
+ * A slice that follows the header, whose size is given by field.
+ */
+typedef struct {
+    enum headerField field;
+    const char *dest; // extracted to this file name
+    bool required; // the slice can't be empty
+} sliceLayout;
+
+#define MAX_SLICES 5
+
+/**
+ * Describes one version of the header, and the slices that follow it. The
+ * header and each slice start on a page boundary, in order.
+ */
+typedef struct {
+    const char *name; // eg. "boot" or "vendor_boot"
+    const char *magic;
+    uint32_t version;
+    uint16_t versionOffset; // where the header version is, for all versions
+    uint16_t size; // of the header itself
+    uint32_t pageSize; // if fixed, rather than given by FIELD_PAGE_SIZE
+    bool vendor;
+    fieldLayout fields[FIELD_COUNT]; //see headerField
+    sliceLayout slices[MAX_SLICES];
+    size_t slicesLen;
+} headerLayout;
+
+#define BOOT_V0_FIELDS \
+    [FIELD_KERNEL_SIZE] = FIELD(boot_img_hdr_v0, kernel_size), \
+    [FIELD_KERNEL_ADDR] = FIELD(boot_img_hdr_v0, kernel_addr), \
+    [FIELD_RAMDISK_SIZE] = FIELD(boot_img_hdr_v0, ramdisk_size), \
+    [FIELD_RAMDISK_ADDR] = FIELD(boot_img_hdr_v0, ramdisk_addr), \
+    [FIELD_SECOND_SIZE] = FIELD(boot_img_hdr_v0, second_size), \
+    [FIELD_SECOND_ADDR] = FIELD(boot_img_hdr_v0, second_addr), \
+    [FIELD_TAGS_ADDR] = FIELD(boot_img_hdr_v0, tags_addr), \
+    [FIELD_PAGE_SIZE] = FIELD(boot_img_hdr_v0, page_size), \
+    [FIELD_OS_VERSION] = FIELD(boot_img_hdr_v0, os_version), \
+    [FIELD_NAME] = FIELD(boot_img_hdr_v0, name), \
+    [FIELD_CMDLINE] = FIELD(boot_img_hdr_v0, cmdline), \
+    [FIELD_EXTRA_CMDLINE] = FIELD(boot_img_hdr_v0, extra_cmdline), \
+    [FIELD_ID] = FIELD(boot_img_hdr_v0, id)
+
+#define BOOT_V1_FIELDS BOOT_V0_FIELDS, \
+    [FIELD_HEADER_VERSION] = FIELD(boot_img_hdr_v0, header_version), \
+    [FIELD_HEADER_SIZE] = FIELD(boot_img_hdr_v1, header_size), \
+    [FIELD_RECOVERY_DTBO_SIZE] = FIELD(boot_img_hdr_v1, recovery_dtbo_size), \
+    [FIELD_RECOVERY_DTBO_OFFSET] = FIELD(boot_img_hdr_v1, recovery_dtbo_offset)
+
+#define BOOT_V2_FIELDS BOOT_V1_FIELDS, \
+    [FIELD_DTB_SIZE] = FIELD(boot_img_hdr_v2, dtb_size), \
+    [FIELD_DTB_ADDR] = FIELD(boot_img_hdr_v2, dtb_addr)
+
+#define BOOT_V3_FIELDS \
+    [FIELD_HEADER_VERSION] = FIELD(boot_img_hdr_v3, header_version), \
+    [FIELD_KERNEL_SIZE] = FIELD(boot_img_hdr_v3, kernel_size), \
+    [FIELD_RAMDISK_SIZE] = FIELD(boot_img_hdr_v3, ramdisk_size), \
+    [FIELD_HEADER_SIZE] = FIELD(boot_img_hdr_v3, header_size), \
+    [FIELD_OS_VERSION] = FIELD(boot_img_hdr_v3, os_version), \
+    [FIELD_CMDLINE] = FIELD(boot_img_hdr_v3, cmdline)
+
+#define BOOT_V4_FIELDS BOOT_V3_FIELDS, \
+    [FIELD_SIGNATURE_SIZE] = FIELD(boot_img_hdr_v4, signature_size)
+
+#define VENDOR_V3_FIELDS \
+    [FIELD_HEADER_VERSION] = FIELD(vendor_boot_img_hdr_v3, header_version), \
+    [FIELD_PAGE_SIZE] = FIELD(vendor_boot_img_hdr_v3, page_size), \
+    [FIELD_KERNEL_ADDR] = FIELD(vendor_boot_img_hdr_v3, kernel_addr), \
+    [FIELD_RAMDISK_ADDR] = FIELD(vendor_boot_img_hdr_v3, ramdisk_addr), \
+    [FIELD_RAMDISK_SIZE] = FIELD(vendor_boot_img_hdr_v3, vendor_ramdisk_size),\
+    [FIELD_CMDLINE] = FIELD(vendor_boot_img_hdr_v3, cmdline), \
+    [FIELD_TAGS_ADDR] = FIELD(vendor_boot_img_hdr_v3, tags_addr), \
+    [FIELD_NAME] = FIELD(vendor_boot_img_hdr_v3, name), \
+    [FIELD_HEADER_SIZE] = FIELD(vendor_boot_img_hdr_v3, header_size), \
+    [FIELD_DTB_SIZE] = FIELD(vendor_boot_img_hdr_v3, dtb_size), \
+    [FIELD_DTB_ADDR] = FIELD(vendor_boot_img_hdr_v3, dtb_addr)
+
+#define VENDOR_V4_FIELDS VENDOR_V3_FIELDS, \
+    [FIELD_VENDOR_RAMDISK_TABLE_SIZE] = \
+        FIELD(vendor_boot_img_hdr_v4, vendor_ramdisk_table_size), \
+    [FIELD_VENDOR_RAMDISK_TABLE_ENTRY_NUM] = \
+        FIELD(vendor_boot_img_hdr_v4, vendor_ramdisk_table_entry_num), \
+    [FIELD_VENDOR_RAMDISK_TABLE_ENTRY_SIZE] = \
+        FIELD(vendor_boot_img_hdr_v4, vendor_ramdisk_table_entry_size), \
+    [FIELD_BOOTCONFIG_SIZE] = FIELD(vendor_boot_img_hdr_v4, bootconfig_size)
+
+#define BOOT_V0_SLICES \
+    { FIELD_KERNEL_SIZE, "kernel.img", true }, \
+    { FIELD_RAMDISK_SIZE, "ramdisk.img", true }, \
+    { FIELD_SECOND_SIZE, "secondary.img", false }
+
+#define BOOT_V3_SLICES \
+    { FIELD_KERNEL_SIZE, "kernel.img", true }, \
+    { FIELD_RAMDISK_SIZE, "ramdisk.img", false }
+
+#define VENDOR_V3_SLICES \
+    { FIELD_RAMDISK_SIZE, "vendor_ramdisk.img", false }, \
+    { FIELD_DTB_SIZE, "dtb.img", false }
+
+const headerLayout headerLayouts[] = {
+    {
+        "boot", BOOT_MAGIC, 0, offsetof(boot_img_hdr_v0, header_version),
+        sizeof(boot_img_hdr_v0), 0, false,
+        { BOOT_V0_FIELDS }, { BOOT_V0_SLICES }, 3
+    },{
+        "boot", BOOT_MAGIC, 1, offsetof(boot_img_hdr_v0, header_version),
+        sizeof(boot_img_hdr_v1), 0, false,
+        { BOOT_V1_FIELDS }, {
+            BOOT_V0_SLICES,
+            { FIELD_RECOVERY_DTBO_SIZE, "recovery_dtbo.img", false }
+        }, 4
+    },{
+        "boot", BOOT_MAGIC, 2, offsetof(boot_img_hdr_v0, header_version),
+        sizeof(boot_img_hdr_v2), 0, false,
+        { BOOT_V2_FIELDS }, {
+            BOOT_V0_SLICES,
+            { FIELD_RECOVERY_DTBO_SIZE, "recovery_dtbo.img", false },
+            { FIELD_DTB_SIZE, "dtb.img", false }
+        }, 5
+    },{
+        "boot", BOOT_MAGIC, 3, offsetof(boot_img_hdr_v3, header_version),
+        sizeof(boot_img_hdr_v3), BOOT_IMAGE_HEADER_V3_PAGESIZE, false,
+        { BOOT_V3_FIELDS }, { BOOT_V3_SLICES }, 2
+    },{
+        "boot", BOOT_MAGIC, 4, offsetof(boot_img_hdr_v3, header_version),
+        sizeof(boot_img_hdr_v4), BOOT_IMAGE_HEADER_V3_PAGESIZE, false,
+        { BOOT_V4_FIELDS }, {
+            BOOT_V3_SLICES,
+            { FIELD_SIGNATURE_SIZE, "boot_signature.img", false }
+        }, 3
+    },{
+        "vendor_boot", VENDOR_BOOT_MAGIC, 3,
+        offsetof(vendor_boot_img_hdr_v3, header_version),
+        sizeof(vendor_boot_img_hdr_v3), 0, true,
+        { VENDOR_V3_FIELDS }, { VENDOR_V3_SLICES }, 2
+    },{
+        "vendor_boot", VENDOR_BOOT_MAGIC, 4,
+        offsetof(vendor_boot_img_hdr_v3, header_version),
+        sizeof(vendor_boot_img_hdr_v4), 0, true,
+        { VENDOR_V4_FIELDS }, {
+            VENDOR_V3_SLICES,
+            {
+                FIELD_VENDOR_RAMDISK_TABLE_SIZE,
+                "vendor_ramdisk_table.img", false
+            },
+            { FIELD_BOOTCONFIG_SIZE, "bootconfig.txt", false }
+        }, 4
+    }
+};
+
+#define HEADER_LAYOUTS_LEN (sizeof(headerLayouts) / sizeof(headerLayout))
+
+// Enough to tell every header version apart, without reading past the end
+// of any of them: the smallest header, which is v3's
+#define HEADER_PREFIX_SIZE sizeof(boot_img_hdr_v3)
+
+// Enough for the largest header version
+#define MAX_HEADER_SIZE sizeof(vendor_boot_img_hdr_v4)
+
+// Enough for the longest command line, including its NUL
+#define MAX_CMDLINE_SIZE (VENDOR_BOOT_ARGS_SIZE + 1)
+
+enum copyMethod {
+    COPY_REFLINK,
+    COPY_RANGE,
+    COPY_SENDFILE,
+    COPY_SPLICE,
+    COPY_BUFFERED,
+    COPY_SPARSE,
+    COPY_SIMG
+};
+
+const char *copyMethodNames[] = { //see copyMethod
+    "reflink",
+    "copy_file_range",
+    "sendfile",
+    "splice",
+    "buffered",
+    "sparse",
+    "simg"
 };
 
+// Size of the buffer used when none of the kernel-assisted copies are
+// available. Large enough that syscall overhead is negligible.
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
 enum destsIndex {
     DEST_MKSCRIPT,
-    DEST_KERNEL,
-    DEST_RAMDISK,
-    DEST_SECOND,
     DEST_NEWBOOT
 };
 
+// When set, throwError() unwinds to this instead of exiting, so that one bad
+// image doesn't take down the rest of a batch.
+__thread jmp_buf *errorTrap = NULL;
+
 #define throwError(message, ...) {\
     fprintf(stderr, "Error in %s(): " message "\n", __func__, ##__VA_ARGS__);\
+    if(errorTrap) longjmp(*errorTrap, 1);\
     exit(EXIT_FAILURE);\
 }
 
 #define throwWarning(message, ...) \
     fprintf(stderr, "Warning in %s(): " message "\n", __func__, ##__VA_ARGS__);
 
+double getMonotonicTime(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+enum statsFormat {
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON
+};
+
+// The phases of an extraction that --stats breaks its time down into
+enum statsPhase {
+    PHASE_OPEN,
+    PHASE_HEADER,
+    PHASE_SLICES,
+    PHASE_SCRIPT,
+    PHASE_CLOSE,
+    PHASE_COUNT
+};
+
+const char *statsPhaseNames[] = { //see statsPhase
+    "open",
+    "header",
+    "slices",
+    "script",
+    "close"
+};
+
+/**
+ * Where the time of a phase went. Kept in nanoseconds, so that the phases of
+ * a whole batch can be totalled up atomically.
+ */
+typedef struct {
+    uint64_t nanoseconds;
+    uint64_t bytes; // read or written by syscalls, counted once for copies
+    uint64_t syscalls; // only a lower bound (see countSyscall())
+} phaseStats;
+
+// The syscalls this thread makes are counted into this, while it's set
+__thread phaseStats *threadStats = NULL;
+
+/**
+ * Counts a syscall that read or wrote bytes, if this thread is in a phase.
+ * This is only an increment, so it's left in even when --stats isn't used.
+ * Only the syscalls made here directly are counted, not those made for us
+ * by stdio's buffering, libsparse, or when closing files, so the count is a
+ * lower bound, and is left out of the JSON stats for that reason.
+ */
+void countSyscall(uint64_t bytes){
+    if(!threadStats) return;
+    threadStats->syscalls++;
+    threadStats->bytes += bytes;
+}
+
+/**
+ * Starts counting this thread's syscalls into phase.
+ * Returns the start time, to hand to endPhase().
+ */
+double beginPhase(phaseStats *phase){
+    threadStats = phase;
+    return getMonotonicTime();
+}
+
+void endPhase(phaseStats *phase, double start){
+    phase->nanoseconds += (getMonotonicTime() - start) * 1e9;
+    threadStats = NULL;
+}
+
+void addPhaseStats(phaseStats *total, const phaseStats *phase){
+    __atomic_add_fetch(
+        &total->nanoseconds, phase->nanoseconds, __ATOMIC_RELAXED
+    );
+    __atomic_add_fetch(&total->bytes, phase->bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&total->syscalls, phase->syscalls, __ATOMIC_RELAXED);
+}
+
 FILE *openFile(const char *path, const char *mode){
     FILE *file = NULL; errno = 0;
     file = fopen(path, mode);
+    countSyscall(0);
     if(errno) throwError(
         "Failed to open \"%s\" in \"%s\" mode. %s",
         path, mode, strerror(errno)
@@ -72,22 +446,54 @@ FILE *openFile(const char *path, const char *mode){
     return file;
 }
 
-void changeDir(const char *dir){
+FILE *openFileAt(int dirFd, const char *path, const char *mode){
+    int fd, flags = O_RDONLY;
+    FILE *file = NULL;
+
+    if(mode[0] == 'w') flags = O_WRONLY | O_CREAT | O_TRUNC;
+    errno = 0;
+    fd = openat(dirFd, path, flags | O_CLOEXEC, 0666);
+    countSyscall(0);
+    if(fd >= 0 && !(file = fdopen(fd, mode))) close(fd);
+    if(!file) throwError(
+        "Failed to open \"%s\" in \"%s\" mode. %s",
+        path, mode, strerror(errno)
+    );
+    return file;
+}
+
+/**
+ * Opens dir, relative to parentFd, creating it first if it doesn't exist,
+ * and returns a descriptor for it that dest files can be opened relative to.
+ * This is used rather than chdir(), as the working directory is shared by
+ * every thread.
+ */
+int openDirAt(int parentFd, const char *dir){
+    int dirFd;
+
+    if(*dir == '\0') dir = ".";
     errno = 0;
-    chdir(dir);
-    if(errno == ENOENT){
+    dirFd = openat(parentFd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    countSyscall(0);
+    if(dirFd < 0 && errno == ENOENT){
         errno = 0;
-        mkdir(dir, 0777);
-        if(errno) throwError(
+        if(mkdirat(parentFd, dir, 0777) && errno != EEXIST) throwError(
             "Failed to create directory \"%s\". %s",
             dir, strerror(errno)
         );
-        chdir(dir);
+        countSyscall(0);
+        dirFd = openat(parentFd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        countSyscall(0);
     }
-    if(errno) throwError(
+    if(dirFd < 0) throwError(
         "Failed to open directory \"%s\". %s",
         dir, strerror(errno)
     );
+    return dirFd;
+}
+
+int openDir(const char *dir){
+    return openDirAt(AT_FDCWD, dir);
 }
 
 size_t getEnclosingDir(char *dir, size_t dirSize, const char *file){
@@ -100,78 +506,293 @@ size_t getEnclosingDir(char *dir, size_t dirSize, const char *file){
     return dirLen;
 }
 
-void readHeader(boot_img_hdr *header, FILE *srcFile){
-    errno = 0;
+/**
+ * Gets the directory that a batch mode image is extracted into: a directory
+ * named after the image, minus its extension (or plus ".d" if it has none),
+ * inside destDir, or inside the image's own directory if destDir is NULL.
+ * Eg. "fw/boot.img" gives "fw/boot/"
+ */
+size_t getBatchDestDir(
+    char *dir, size_t dirSize, const char *file, const char *destDir
+){
+    const char *name = rindex(file, '/'), *ext;
+    size_t dirLen, nameLen;
+    int ret;
 
-    // Read header info supplied buffer
-    rewind(srcFile);
-    if(errno) throwError("Failed to rewind to start. %s", strerror(errno));
-    fread(header, sizeof(boot_img_hdr), 1, srcFile);
-    if(errno) throwError("Failed to read header. %s", strerror(errno));
+    name = name ? name + 1 : file;
+    ext = rindex(name, '.');
+    nameLen = ext && ext != name ? (size_t)(ext - name) : strlen(name);
 
-    // Validate critical header values
-    if(strncmp(header->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) != 0)
-        throwError("Invalid magic number at start of header");
-    if(header->kernel_size == 0) throwError("Invalid kernel_size");
-    if(header->ramdisk_size == 0) throwError("Invalid ramdisk_size");
+    if(destDir) ret = snprintf(dir, dirSize, "%s/", destDir);
+    else ret = getEnclosingDir(dir, dirSize, file) - 1;
+    if(ret < 0 || (size_t)ret >= dirSize) return 0;
+    dirLen = ret;
+
+    ret = snprintf(
+        dir + dirLen, dirSize - dirLen, "%.*s%s/",
+        (int)nameLen, name, ext && ext != name ? "" : ".d"
+    );
+    if(ret < 0 || (size_t)ret >= dirSize - dirLen) return 0;
+    return dirLen + ret + 1;
 }
 
+/**
+ * A header of any supported version, read in place from raw.
+ */
+typedef struct {
+    const headerLayout *layout;
+    const uint8_t *raw;
+} bootHeader;
+
+bool hasHeaderField(const bootHeader *header, enum headerField field){
+    if(field == FIELD_PAGE_SIZE && header->layout->pageSize) return true;
+    return header->layout->fields[field].size != 0;
+}
 
 /**
- * Gets the actual size of all slices in the bootimg, without rounding up to
- * the nearest page.
- * Eg. sizeMap[SLICE_KERNEL] gives the size of the kernel slice
+ * Returns the value of a numeric header field, or 0 if the header doesn't
+ * have it.
  */
-void getSizeMap(uint32_t sizeMap[4], const boot_img_hdr *header){
-    for(int slice = 0; slice < 4; slice++){
-        uint32_t size;
+uint64_t getHeaderField(const bootHeader *header, enum headerField field){
+    fieldLayout layout = header->layout->fields[field];
+    uint32_t value32;
+    uint64_t value64;
 
-        switch(slice){
-            case SLICE_HEADER: size = sizeof(boot_img_hdr); break;
-            case SLICE_KERNEL: size = header->kernel_size; break;
-            case SLICE_RAMDISK: size = header->ramdisk_size; break;
-            case SLICE_SECOND: size = header->second_size; break;
-            default: size = 0;
-        }
+    if(field == FIELD_PAGE_SIZE && header->layout->pageSize)
+        return header->layout->pageSize;
+    switch(layout.size){
+        case sizeof(value32):
+            memcpy(&value32, header->raw + layout.offset, sizeof(value32));
+            return value32;
+        case sizeof(value64):
+            memcpy(&value64, header->raw + layout.offset, sizeof(value64));
+            return value64;
+        default: return 0;
+    }
+}
+
+/**
+ * Copies a string header field into buffer, NUL terminated, and returns it.
+ * The command line includes the extra command line, if there is one.
+ */
+const char *getHeaderString(
+    char *buffer, size_t bufferSize,
+    const bootHeader *header, enum headerField field
+){
+    fieldLayout layout = header->layout->fields[field];
+    fieldLayout extra = header->layout->fields[FIELD_EXTRA_CMDLINE];
+
+    snprintf(
+        buffer, bufferSize, "%.*s%.*s",
+        layout.size, header->raw + layout.offset,
+        field == FIELD_CMDLINE ? extra.size : 0, header->raw + extra.offset
+    );
+    return buffer;
+}
+
+/**
+ * A slice of the image, as found by getSliceMap().
+ */
+typedef struct {
+    const sliceLayout *layout;
+    uint32_t offset, size;
+} slice;
+
+typedef struct {
+    slice slices[MAX_SLICES];
+    size_t len;
+} sliceMap;
+
+/**
+ * Works out the offset and size of every slice that follows header, in a
+ * single pass over its layout, with each slice page-aligned.
+ * Returns the offset of the end of the last slice.
+ */
+uint64_t getSliceMap(sliceMap *map, const bootHeader *header){
+    const headerLayout *layout = header->layout;
+    uint64_t pageSize = getHeaderField(header, FIELD_PAGE_SIZE);
+    uint64_t offset = 0, size = layout->size;
+
+    map->len = 0;
+    for(size_t i = 0; i <= layout->slicesLen; i++){
+        // Slice size in bytes is the header's size for the slice, but
+        // rounded up to the nearest page.
+        offset += (size + pageSize - 1) / pageSize * pageSize;
+        if(i == layout->slicesLen) break;
+
+        size = getHeaderField(header, layout->slices[i].field);
+        map->slices[map->len++] = (slice){
+            &layout->slices[i], offset, size
+        };
+    }
+
+    return offset;
+}
+
+/**
+ * Finds the layout for the header at the start of raw, by its magic number
+ * and header version.
+ * Returns NULL if there isn't one, with a description of why in error.
+ */
+const headerLayout *findHeaderLayout(
+    const uint8_t *raw, size_t size, const char **error
+){
+    const headerLayout *fallback = NULL;
+    bool magicFound = false;
+
+    for(size_t i = 0; i < HEADER_LAYOUTS_LEN; i++){
+        const headerLayout *layout = &headerLayouts[i];
+        size_t magicSize = strlen(layout->magic);
+        uint32_t version;
+
+        if(size < layout->versionOffset + sizeof(version)) continue;
+        if(memcmp(raw, layout->magic, magicSize) != 0) continue;
+        magicFound = true;
+        if(layout->version == 0) fallback = layout;
+
+        memcpy(&version, raw + layout->versionOffset, sizeof(version));
+        if(version == layout->version) return layout;
+    }
+
+    // Before header versions, some vendors put other things where the
+    // header version is now (eg. a dt.img size), so these are still read as
+    // version 0
+    if(fallback) return fallback;
+
+    *error = magicFound
+        ? "Unsupported header version"
+        : "Invalid magic number at start of header";
+    return NULL;
+}
+
+/**
+ * Reads the header at the start of raw into header, and checks its critical
+ * values. size is how much of the image raw holds.
+ * Returns NULL if they're valid, or else a description of what isn't.
+ */
+const char *parseHeader(bootHeader *header, const uint8_t *raw, size_t size){
+    static __thread char error[64];
+    const char *layoutError = NULL;
+    sliceMap slices;
+
+    header->raw = raw;
+    header->layout = findHeaderLayout(raw, size, &layoutError);
+    if(!header->layout) return layoutError;
+    if(size < header->layout->size) return "Unexpected end of input";
+    if(getHeaderField(header, FIELD_PAGE_SIZE) == 0)
+        return "Invalid page_size";
 
-        sizeMap[slice] = size;
+    if(getSliceMap(&slices, header) > UINT32_MAX)
+        return "Slices extend past 4GiB";
+    for(size_t i = 0; i < slices.len; i++){
+        if(!slices.slices[i].layout->required || slices.slices[i].size)
+            continue;
+        snprintf(
+            error, sizeof(error), "Invalid %s",
+            headerFields[slices.slices[i].layout->field].key
+        );
+        return error;
     }
+    return NULL;
+}
+
+void validateHeader(bootHeader *header, const uint8_t *raw, size_t size){
+    const char *error = parseHeader(header, raw, size);
+    if(error) throwError("%s", error);
 }
 
 /**
- * Gets the offsets of all slices in the bootimg, with each slice page-aligned.
- * Eg. offsetMap[SLICE_KERNEL] gives the offset of the kernel in the
- * bootimg.
- * offsetMap[SLICE_SECOND+1] gives the end of SLICE_SECOND
+ * Reads and validates the header from the start of srcFile into header,
+ * using buffer to hold it, with a single positional read.
  */
-void getOffsetMap(uint32_t offsetMap[4], const boot_img_hdr *header){
-    uint32_t pageSize = header->page_size;
-    uint32_t sizeMap[4];
+void readHeader(
+    bootHeader *header, uint8_t buffer[MAX_HEADER_SIZE], FILE *srcFile
+){
+    ssize_t ret;
 
-    getSizeMap(sizeMap, header);
+    do ret = pread(fileno(srcFile), buffer, MAX_HEADER_SIZE, 0);
+    while(ret < 0 && errno == EINTR);
+    if(ret < 0) throwError("Failed to read header. %s", strerror(errno));
+    countSyscall(ret);
 
-    offsetMap[0] = 0;
-    for(int slice = 0; slice < 3; slice++){
-        uint32_t currSliceSize = sizeMap[slice];
+    // Validate critical header values
+    validateHeader(header, buffer, ret);
+}
+
+/**
+ * A read-only view of an entire boot image, mapped into memory so that the
+ * header and slices can be used in place, without being copied.
+ */
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+} imageMap;
 
-        // Slice size in bytes is the kernel/ramdisk/second size, but rounded
-        // up to the nearest page.
-        currSliceSize = ((currSliceSize + pageSize - 1) / pageSize) * pageSize;
+void mapImage(imageMap *map, FILE *srcFile){
+    struct stat srcStat;
+    void *data;
 
-        offsetMap[slice+1] = offsetMap[slice] + currSliceSize;
+    errno = 0;
+    if(fstat(fileno(srcFile), &srcStat)) throwError(
+        "Failed to stat source image. %s", strerror(errno)
+    );
+    countSyscall(0);
+    if(!S_ISREG(srcStat.st_mode) && !S_ISBLK(srcStat.st_mode)) throwError(
+        "Source image must be a regular file or block device to be mapped"
+    );
+    if(S_ISBLK(srcStat.st_mode)){
+        off_t end = lseek(fileno(srcFile), 0, SEEK_END);
+        if(end < 0) throwError(
+            "Failed to find size of source image. %s", strerror(errno)
+        );
+        srcStat.st_size = end;
     }
+    if((size_t)srcStat.st_size < HEADER_PREFIX_SIZE) throwError(
+        "Source image is smaller than a boot image header"
+    );
+
+    data = mmap(
+        NULL, srcStat.st_size, PROT_READ, MAP_SHARED, fileno(srcFile), 0
+    );
+    countSyscall(0);
+    if(data == MAP_FAILED) throwError(
+        "Failed to map source image. %s", strerror(errno)
+    );
+
+    // Slices are consumed front to back, so encourage aggressive readahead
+    if(madvise(data, srcStat.st_size, MADV_SEQUENTIAL)) throwWarning(
+        "Failed to advise sequential access. %s", strerror(errno)
+    );
+    countSyscall(0);
+
+    map->data = data;
+    map->size = srcStat.st_size;
+}
+
+void unmapImage(imageMap *map){
+    if(map->data) munmap((void*)map->data, map->size);
+    map->data = NULL;
+    map->size = 0;
+}
+
+/**
+ * Validates the header at the start of map in place, and points header at
+ * it within the mapping.
+ */
+void mapHeader(bootHeader *header, const imageMap *map){
+    validateHeader(header, map->data, map->size);
 }
 
 #define OS_VERSION_SIZE 12
 void getOsVersion(
-    char version[12], char patchLevel[12], const boot_img_hdr *header
+    char version[12], char patchLevel[12], uint32_t osVersion
 ){
     uint8_t a = 0, b = 0, c = 0;
     uint8_t y = 0, m = 0, d = 1;
 
     // Raw bit layout: aaaaaaabbbbbbbcccccccyyyyyyymmmm
-    uint32_t rawVersion = header->os_version >> 11;
-    uint16_t rawPatchLevel = header->os_version & 2047;
+    uint32_t rawVersion = osVersion >> 11;
+    uint16_t rawPatchLevel = osVersion & 2047;
 
     // Extract version
     a = (rawVersion >> 14) & 127;
@@ -190,17 +811,15 @@ void getOsVersion(
 #define IMAGE_ID_SIZE (BOOT_ID_SIZE * 3 + 1)
 void getImageId(
 	char imageId[IMAGE_ID_SIZE],
-	const boot_img_hdr *header,
+	const uint8_t id[BOOT_ID_SIZE],
 	bool noSeparator
 ){
-	// We want to deal with header->id one byte at a time, not one uint32_t
-    uint8_t *id = (void*)header->id;
 	bool isSha1 = true;
 	char *separator;
 	size_t i; //offset in id
 	int j; //offset in imageId string
 
-	// If the last three 32b uints of header->id are zero, then lets assume
+	// If the last three 32b uints of id are zero, then lets assume
 	// that the first 5 uints (160 bits) aren't, and that this is an sha1
 	// digest
 	for(i = 20; i < BOOT_ID_SIZE; i++) if(id[i] > 0) isSha1 = false;
@@ -228,233 +847,3613 @@ void getImageId(
     }
 }
 
-void writeHeaderInfo(FILE *destFile, boot_img_hdr *header){
-	char osVersion[OS_VERSION_SIZE], osPatchLevel[OS_VERSION_SIZE];
-	char imageId[IMAGE_ID_SIZE];
-
-	fprintf(destFile, "Kernel size: %uB\n", header->kernel_size);
-	fprintf(destFile, "Kernel load address: %#x\n", header->kernel_addr);
+/**
+ * Returns a pointer to the image ID within header. Only valid if header
+ * has FIELD_ID.
+ */
+const uint8_t *getHeaderId(const bootHeader *header){
+    return header->raw + header->layout->fields[FIELD_ID].offset;
+}
 
-	fprintf(destFile, "Ramdisk size: %uB\n", header->ramdisk_size);
-	fprintf(destFile, "Ramdisk load address: %#x\n", header->ramdisk_addr);
+/**
+ * Writes the human readable line(s) for field of header, each starting with
+ * prefix. Writes nothing if header doesn't have field.
+ */
+void writeHeaderField(
+	FILE *destFile, const bootHeader *header, enum headerField field,
+	const char *prefix
+){
+	char osVersion[OS_VERSION_SIZE], osPatchLevel[OS_VERSION_SIZE];
+	char imageId[IMAGE_ID_SIZE], string[MAX_CMDLINE_SIZE];
+	const headerFieldInfo *info = &headerFields[field];
+	unsigned long long value;
 
-	fprintf(destFile, "Second size: %uB\n", header->second_size);
-	fprintf(destFile, "Second load address: %#x\n", header->second_addr);
+	if(!hasHeaderField(header, field)) return;
+	value = getHeaderField(header, field);
+	switch(info->type){
+		case TYPE_NUMBER:
+			fprintf(destFile, "%s%s: %llu\n", prefix, info->label, value);
+			break;
+		case TYPE_SIZE:
+			fprintf(destFile, "%s%s: %lluB\n", prefix, info->label, value);
+			break;
+		case TYPE_ADDR:
+			fprintf(destFile, "%s%s: %#llx\n", prefix, info->label, value);
+			break;
+		case TYPE_OS_VERSION:
+			getOsVersion(osVersion, osPatchLevel, value);
+			fprintf(destFile,
+				"%s%s: %s\n%sAndroid patch Level: %s\n",
+				prefix, info->label, osVersion, prefix, osPatchLevel
+			);
+			break;
+		case TYPE_STRING:
+			// The extra command line is included in the command line
+			if(field == FIELD_EXTRA_CMDLINE) break;
+			fprintf(destFile, "%s%s%s: \"%s\"\n", prefix, info->label,
+				field == FIELD_CMDLINE
+					&& hasHeaderField(header, FIELD_EXTRA_CMDLINE)
+					? " (including extra)" : "",
+				getHeaderString(string, sizeof(string), header, field)
+			);
+			break;
+		case TYPE_ID:
+			getImageId(imageId, getHeaderId(header), false);
+			fprintf(destFile, "%s%s: %s\n", prefix, info->label, imageId);
+			break;
+	}
+}
 
-	fprintf(destFile, "Tags address: %#x\n", header->tags_addr);
-	fprintf(destFile, "Page size: %uB\n", header->page_size);
+void writeHeaderInfo(FILE *destFile, const bootHeader *header){
+	if(header->layout->vendor)
+		fprintf(destFile, "Image type: %s\n", header->layout->name);
 
-	getOsVersion(osVersion, osPatchLevel, header);
-	fprintf(destFile, 
-		"Android version: %s\nAndroid patch Level: %s\n",
-		osVersion, osPatchLevel
-	);
+	for(int field = 0; field < FIELD_COUNT; field++)
+		writeHeaderField(destFile, header, field, "");
+}
 
-	fprintf(destFile, "Product name: \"%.*s\"\n", BOOT_NAME_SIZE, header->name);
-	
-	fprintf(destFile, 
-		"Command line (including extra): \"%.*s%.*s\"\n",
-		BOOT_ARGS_SIZE, header->cmdline,
-		BOOT_EXTRA_ARGS_SIZE, header->extra_cmdline
-	);
+/**
+ * Returns the mkbootimg option that sets field, for the type of image that
+ * header is from.
+ */
+const char *getScriptArg(const bootHeader *header, enum headerField field){
+    const headerFieldInfo *info = &headerFields[field];
 
-	getImageId(imageId, header, false);
-	fprintf(destFile, "Image ID (eg. checksum): %s\n", imageId);
+    if(header->layout->vendor && info->vendorScriptArg)
+        return info->vendorScriptArg;
+    return info->scriptArg;
 }
 
+/**
+ * Writes the remake script, which passes each of the slices in slices back
+ * to mkbootimg, along with every header field that mkbootimg can set. If the
+ * ramdisk was unpacked into ramdiskDir rather than extracted (ramdiskDir is
+ * NULL otherwise), the script first rebuilds it with mkbootfs, piped through
+ * compressCmd. If simg is set, the other slices are Android sparse images
+ * padded out to whole blocks, so the script unsparses each one with simg2img
+ * and truncates it back to its size in the header first, and passes that
+ * to mkbootimg instead. If mkbootimgCmd is NULL, the script calls the
+ * mkbootimg that can write this header: the one built here for version 0, or
+ * else AOSP's mkbootimg.py, as only that takes the options that later
+ * versions add.
+ */
 void writeMakeScript(
-    FILE *destFile, char **dests,
-    const char *mkbootimgCmd, const boot_img_hdr *header
+    FILE *destFile, const bootHeader *header, const sliceMap *slices,
+    const char *mkbootimgCmd, const char *newBoot,
+    const char *ramdiskDir, const char *compressCmd, bool simg
 ){
     char osVersion[12] = "", osPatchLevel[12] = "";
-
-    // Calculate version information
-    getOsVersion(osVersion, osPatchLevel, header);
+    char string[MAX_CMDLINE_SIZE];
+    bool isSlice[FIELD_COUNT] = { false };
+    bool unsparse[MAX_SLICES] = { false };
 
     // Write the script
     fprintf(destFile, "#!/bin/sh\n");
+    if(ramdiskDir) for(size_t i = 0; i < slices->len; i++){
+        const slice *slice = &slices->slices[i];
+
+        if(slice->layout->field == FIELD_RAMDISK_SIZE) fprintf(
+            destFile, "mkbootfs \"%s\" | %s > \"%s\" || exit 1\n",
+            ramdiskDir, compressCmd, slice->layout->dest
+        );
+    }
+    if(simg) for(size_t i = 0; i < slices->len; i++){
+        const slice *slice = &slices->slices[i];
+
+        if(slice->size == 0 || !getScriptArg(header, slice->layout->field)
+            || (ramdiskDir && slice->layout->field == FIELD_RAMDISK_SIZE)
+        ) continue;
+        unsparse[i] = true;
+        fprintf(
+            destFile, "simg2img \"%s\" \"%s.raw\" "
+            "&& truncate -s %u \"%s.raw\" || exit 1\n",
+            slice->layout->dest, slice->layout->dest,
+            slice->size, slice->layout->dest
+        );
+    }
+    if(!mkbootimgCmd && (header->layout->vendor || header->layout->version)){
+        mkbootimgCmd = "mkbootimg.py";
+        fprintf(destFile,
+            "# Only AOSP's mkbootimg.py (system/tools/mkbootimg) can write\n"
+            "# this header, not the mkbootimg from android-unmkbootimg\n"
+        );
+    }else if(!mkbootimgCmd) mkbootimgCmd = "mkbootimg";
     fprintf(destFile, "%s \\\n", mkbootimgCmd);
-    fprintf(destFile, " --kernel \"%s\" \\\n", dests[1]);
-    fprintf(destFile, " --ramdisk \"%s\" \\\n", dests[2]);
-    if(header->second_size)
-        fprintf(destFile, " --second \"%s\" \\\n", dests[3]);
-    fprintf(
-        destFile, " --cmdline \"%.*s%.*s\"\\\n",
-		BOOT_ARGS_SIZE, header->cmdline,
-		BOOT_EXTRA_ARGS_SIZE, header->extra_cmdline
-	);
-    fprintf(destFile, " --base %#x \\\n", 0);
-    fprintf(destFile, " --kernel_offset %#x \\\n", header->kernel_addr);
-    fprintf(destFile, " --ramdisk_offset %#x \\\n", header->ramdisk_addr);
-    fprintf(destFile, " --second_offset %#x \\\n", header->second_addr);
-    fprintf(destFile, " --os_version \"%s\" \\\n", osVersion);
-    fprintf(destFile, " --os_patch_level \"%s\" \\\n", osPatchLevel);
-    fprintf(destFile, " --tags_offset %#x \\\n", header->tags_addr);
-    fprintf(destFile, " --board \"%.*s\" \\\n", BOOT_NAME_SIZE, header->name);
-    fprintf(destFile, " --pagesize %#x \\\n", header->page_size);
-    fprintf(destFile, " --output \"%s\"\n", dests[DEST_NEWBOOT]);
+    for(size_t i = 0; i < slices->len; i++){
+        const slice *slice = &slices->slices[i];
+        const char *arg = getScriptArg(header, slice->layout->field);
+
+        isSlice[slice->layout->field] = true;
+        if(slice->size == 0 || !arg) continue;
+        fprintf(destFile, " %s \"%s%s\" \\\n",
+            arg, slice->layout->dest, unsparse[i] ? ".raw" : ""
+        );
+    }
+    if(hasHeaderField(header, FIELD_KERNEL_ADDR))
+        fprintf(destFile, " --base %#x \\\n", 0);
+
+    for(int field = 0; field < FIELD_COUNT; field++){
+        const char *arg = getScriptArg(header, field);
+        unsigned long long value = getHeaderField(header, field);
+
+        // Fixed values (eg. the page size since version 3) can't be set
+        if(!arg || isSlice[field] || !header->layout->fields[field].size)
+            continue;
+        switch(headerFields[field].type){
+            case TYPE_NUMBER:
+                fprintf(destFile, " %s %llu \\\n", arg, value);
+                break;
+            case TYPE_SIZE:
+            case TYPE_ADDR:
+                fprintf(destFile, " %s %#llx \\\n", arg, value);
+                break;
+            case TYPE_OS_VERSION:
+                getOsVersion(osVersion, osPatchLevel, value);
+                fprintf(destFile, " %s \"%s\" \\\n", arg, osVersion);
+
+                // Month 0 means there's no patch level, which mkbootimg
+                // would refuse, and leaves as 0 anyway
+                if(value & 15) fprintf(
+                    destFile, " --os_patch_level \"%s\" \\\n", osPatchLevel
+                );
+                break;
+            case TYPE_STRING:
+                fprintf(destFile, " %s \"%s\" \\\n", arg,
+                    getHeaderString(string, sizeof(string), header, field)
+                );
+                break;
+            case TYPE_ID: break;
+        }
+    }
+    fprintf(destFile, " %s \"%s\"\n",
+        header->layout->vendor ? "--vendor_boot" : "--output", newBoot
+    );
+
+    // Write the script out now rather than when it's closed, so that it's
+    // counted as part of writing it
+    if(fflush(destFile)) throwError(
+        "Failed to write remake script. %s", strerror(errno)
+    );
+    countSyscall(ftell(destFile));
 
     // Make sure the script is executable
     errno = 0;
     fchmod(fileno(destFile), 0750);
+    countSyscall(0);
     if(errno) throwWarning(
         "Failed to change file mode to 0750. %s",
         strerror(errno)
     );
 }
 
-void writeSlice(
-    FILE *srcFile, FILE *destFile,
-    size_t blockSize, size_t byteOffset, size_t byteCount
-){
-    int err = 0;
-
-    // Allocate a blockSized buffer to reduce fread operations and thus system
-    // call overhead
-    void *buffer = NULL;
-    if(!(buffer = calloc(1, blockSize))) throwError(
-        "Failed to allocate buffer of blockSize %luB. %s",
-        blockSize, strerror(errno)
-    );
-
-    // Ensure that file is at the right position
-    fseek(srcFile, byteOffset, SEEK_SET);
-    rewind(destFile);
+enum scanFormat {
+    SCAN_NONE,
+    SCAN_JSON,
+    SCAN_CSV
+};
 
-    // Begin extracting slice, one blockSize at a time
-    for(size_t i = 0; i < byteCount / blockSize + 1; i++){
-        size_t quota;
+// Scan records are flushed to stdout once this much has built up
+#define SCAN_FLUSH_SIZE (64 * 1024)
 
-        if((quota = byteCount - i * blockSize) < blockSize);
-        else quota = blockSize;
-        if(quota == 0) break;
+/**
+ * Writes size bytes of str (or up to its NUL) as a quoted JSON string.
+ * Control characters and bytes outside of ASCII are escaped.
+ */
+void writeJsonString(FILE *destFile, const char *str, size_t size){
+    fputc('"', destFile);
+    for(size_t i = 0; i < size && str[i]; i++){
+        uint8_t c = str[i];
 
-        if(fread(buffer, quota, 1, srcFile) < 1){
-            err = errno;
-            if(feof(srcFile)){
-                throwError(
-                    "Unexpected end of input. Current offset: %luB. %s",
-                    byteCount + i * blockSize, strerror(err)
-                );
-            }else{
-                throwError(
-                    "Failed to read file. Current offset: %luB. %s",
-                    byteCount + i * blockSize, strerror(err)
-                );
-            }
-        }
+        if(c == '"' || c == '\\') fprintf(destFile, "\\%c", c);
+        else if(c < 0x20 || c >= 0x7f) fprintf(destFile, "\\u%04x", c);
+        else fputc(c, destFile);
+    }
+    fputc('"', destFile);
+}
 
-        if(fwrite(buffer, quota, 1, destFile) < 1){
-            throwError("Failed to write to file. %s", strerror(errno));
-        }
+/**
+ * Writes size bytes of str (or up to its NUL) as a quoted CSV field.
+ */
+void writeCsvString(FILE *destFile, const char *str, size_t size){
+    fputc('"', destFile);
+    for(size_t i = 0; i < size && str[i]; i++){
+        if(str[i] == '"') fputc('"', destFile);
+        fputc(str[i], destFile);
     }
+    fputc('"', destFile);
+}
 
-    free(buffer);
+/**
+ * Returns true if field gets its own key (or column) in scan records. The
+ * header version is always written first, and the extra command line is
+ * included in the command line.
+ */
+bool isScanField(enum headerField field){
+    return field != FIELD_HEADER_VERSION && field != FIELD_EXTRA_CMDLINE;
 }
 
-void usage(char **args){
-    printf(
-        "Usage: %s [OPTIONS] <src>\n\n"
-        "Extracts the kernel, ramdisk, and second-stage bootloader from the\n"
-        "provided Android boot image, and outputs them to the same directory.\n"
-        "Furthermore, this also creates a remake script that recombines these\n"
-        "extracted images into newboot.img, by running mkbootimg with the\n"
-        "parameters extracted from the original image header of src.\n\n"
-        "OPTIONS:\n"
-        "\t<src>: The source Android boot image file to extract from.\n"
-        "\t-d <destDir>: Output extracted images here instead.\n"
-        "\t-v: Verbose.\n"
-		"\t-i: Print header information only, then exit.\n"
-        "\t-r <remakeScript>: Save the remake script using this filename\n"
-        "\t\tinstead.\n"
-        "\t-m <mkbootimgCmd>: Use this command in the remake script for\n"
-        "\t\tmkbootimg instead.\n"
-        "\t-n <newBootImgName>: Direct the remake script to output the\n"
-        "\t\tremade boot image using this filename instead, rather than\n"
-        "\t\tnewboot.img.\n",
-        args[0]
-    );
+/**
+ * Writes the CSV header row, naming the column of every field that any
+ * header version has.
+ */
+void writeScanColumns(FILE *destFile){
+    fprintf(destFile, "path,image_type,header_version");
+    for(int field = 0; field < FIELD_COUNT; field++){
+        if(!isScanField(field)) continue;
+        fprintf(destFile, ",%s", headerFields[field].key);
+        if(headerFields[field].type == TYPE_OS_VERSION)
+            fprintf(destFile, ",os_patch_level");
+    }
+    fprintf(destFile, ",error\n");
 }
 
-int main(int argsLen, char **args){
-    char *src = NULL;
-    char *destDir = NULL; bool destDirMalloced = false;
-    char *dests[] = { //see destIndex
-        "remkbootimg.sh",
-        "kernel.img",
-        "ramdisk.img",
-        "secondary.img",
-        "newboot.img"
-    };
-    FILE *srcFile = NULL, *destFile = NULL;
-    boot_img_hdr header;
-    uint32_t offsetMap[4], sizeMap[4];
-    bool verbose = false, onlyPrintHeader = false;
-    char *mkbootimgCmd = "mkbootimg";
+/**
+ * Writes one machine-readable record describing the header of the image at
+ * path, or if header is NULL, the error that prevented it being read. JSON
+ * records only have the fields that the header does, while CSV records
+ * leave the columns of the rest empty.
+ */
+void writeScanRecord(
+    FILE *destFile, enum scanFormat format, const char *path,
+    const bootHeader *header, const char *error
+){
+    void (*writeString)(FILE*, const char*, size_t) =
+        format == SCAN_JSON ? writeJsonString : writeCsvString;
+    bool json = format == SCAN_JSON;
+    char osVersion[OS_VERSION_SIZE], osPatchLevel[OS_VERSION_SIZE];
+    char string[MAX_CMDLINE_SIZE];
 
-    // Parse supplied arguments
-    int opt = 0;
-    while((opt = getopt(argsLen, args, "-s:d:vir:m:n:")) >= 0) switch(opt){
-		case 1: src = optarg; break;
-        case 'd': destDir = optarg; break;
-        case 'v': verbose = true; onlyPrintHeader = false; break;
-		case 'i': onlyPrintHeader = true; verbose = false; break;
-        case 'r': dests[DEST_MKSCRIPT] = optarg; break;
-        case 'm': mkbootimgCmd = optarg; break;
-        case 'n': dests[DEST_NEWBOOT] = optarg; break;
-        default:
-            usage(args);
-            return EXIT_FAILURE;
-    };
+    if(json) fprintf(destFile, "{\"path\":");
+    writeString(destFile, path, SIZE_MAX);
 
-    // Open srcFile
-    if(src == NULL){
-        usage(args);
-        return EXIT_FAILURE;
+    if(!header){
+        if(json) fprintf(destFile, ",\"error\":");
+        else{
+            // Skip past every column but the error
+            fprintf(destFile, ",,");
+            for(int field = 0; field < FIELD_COUNT; field++){
+                if(!isScanField(field)) continue;
+                fprintf(destFile, ",");
+                if(headerFields[field].type == TYPE_OS_VERSION)
+                    fprintf(destFile, ",");
+            }
+            fprintf(destFile, ",");
+        }
+        writeString(destFile, error, SIZE_MAX);
+        fprintf(destFile, json ? "}\n" : "\n");
+        return;
     }
-    srcFile = openFile(src, "r");
 
-    // Extract src's parent directory pathname, then chdir into it
-    if(destDir == NULL){
-        destDir = malloc(PATH_MAX);
-        destDirMalloced = true;
-        getEnclosingDir(destDir, PATH_MAX, src);
+    fprintf(destFile,
+        json ? ",\"image_type\":\"%s\",\"header_version\":%u" : ",%s,%u",
+        header->layout->name, header->layout->version
+    );
+    for(int field = 0; field < FIELD_COUNT; field++){
+        const headerFieldInfo *info = &headerFields[field];
+        unsigned long long value = getHeaderField(header, field);
+        bool has = hasHeaderField(header, field);
+
+        if(!isScanField(field) || (json && !has)) continue;
+        if(json) fprintf(destFile, ",\"%s\":", info->key);
+        else fprintf(destFile, ",");
+        if(!has){
+            if(info->type == TYPE_OS_VERSION) fprintf(destFile, ",");
+            continue;
+        }
+
+        switch(info->type){
+            case TYPE_NUMBER:
+            case TYPE_SIZE:
+                fprintf(destFile, "%llu", value);
+                break;
+            case TYPE_ADDR:
+                fprintf(destFile, json ? "%llu" : "%#llx", value);
+                break;
+            case TYPE_OS_VERSION:
+                getOsVersion(osVersion, osPatchLevel, value);
+                fprintf(destFile,
+                    json ? "\"%s\",\"os_patch_level\":\"%s\"" : "%s,%s",
+                    osVersion, osPatchLevel
+                );
+                break;
+            case TYPE_STRING:
+                getHeaderString(string, sizeof(string), header, field);
+                writeString(destFile, string, sizeof(string));
+                break;
+            case TYPE_ID:
+                if(json) fputc('"', destFile);
+                for(size_t i = 0; i < BOOT_ID_SIZE; i++)
+                    fprintf(destFile, "%02x", getHeaderId(header)[i]);
+                if(json) fputc('"', destFile);
+                break;
+        }
+    }
+    fprintf(destFile, json ? "}\n" : ",\n");
+}
+
+/**
+ * Reads just the header of the image at src, with a single read, and writes
+ * a scan record for it to destFile.
+ * Returns false if the header couldn't be read or is invalid.
+ */
+bool scanImage(const char *src, enum scanFormat format, FILE *destFile){
+    uint8_t buffer[MAX_HEADER_SIZE];
+    bootHeader header;
+    const char *error = NULL;
+    bool isStdin = strcmp(src, "-") == 0;
+    int srcFd = isStdin ? STDIN_FILENO : open(src, O_RDONLY | O_CLOEXEC);
+    ssize_t ret = 0;
+
+    if(srcFd < 0) error = strerror(errno);
+    else{
+        // Pipes can return short reads, so keep going until EOF
+        if(isStdin) for(ssize_t got = 1; got > 0;){
+            if((size_t)ret == sizeof(buffer)) break;
+            got = read(srcFd, buffer + ret, sizeof(buffer) - ret);
+            ret = got < 0 ? got : ret + got;
+        }
+        else ret = pread(srcFd, buffer, sizeof(buffer), 0);
+
+        if(ret < 0) error = strerror(errno);
+        else error = parseHeader(&header, buffer, ret);
+        if(!isStdin) close(srcFd);
+    }
+
+    writeScanRecord(destFile, format, src, error ? NULL : &header, error);
+    return !error;
+}
+
+/**
+ * Returns true if err indicates that a kernel-assisted copy method isn't
+ * supported for this pair of files, and that the next method should be tried.
+ */
+bool isCopyUnsupported(int err){
+    return err == ENOSYS || err == EXDEV || err == EINVAL
+        || err == EOPNOTSUPP || err == ENOTTY || err == EPERM;
+}
+
+/**
+ * Attempts to share the extents of the slice with destFd, rather than copying
+ * any data. This only works on filesystems such as btrfs and XFS, and only if
+ * byteOffset is aligned to the filesystem's block size. As the clone length
+ * must also be block aligned (unless it runs to the end of srcFd), the page
+ * padding after the slice gets cloned too, then truncated off again.
+ * Returns false if reflinks aren't possible here, without writing anything.
+ */
+bool cloneSlice(int srcFd, int destFd, size_t byteOffset, size_t byteCount){
+    struct stat srcStat;
+    struct file_clone_range range;
+    size_t blockSize, cloneLen;
+
+    countSyscall(0);
+    if(fstat(srcFd, &srcStat) || srcStat.st_blksize <= 0) return false;
+    blockSize = srcStat.st_blksize;
+    if(byteOffset % blockSize) return false;
+
+    cloneLen = (byteCount + blockSize - 1) / blockSize * blockSize;
+    if(byteOffset + cloneLen >= (size_t)srcStat.st_size){
+        if(byteOffset + byteCount > (size_t)srcStat.st_size) return false;
+        cloneLen = 0; // ie. clone through to the end of srcFd
+    }
+
+    range.src_fd = srcFd;
+    range.src_offset = byteOffset;
+    range.src_length = cloneLen;
+    range.dest_offset = 0;
+    if(ioctl(destFd, FICLONERANGE, &range)){
+        countSyscall(0);
+        return false;
+    }
+    countSyscall(byteCount);
+
+    errno = 0;
+    ftruncate(destFd, byteCount);
+    countSyscall(0);
+    if(errno) throwError(
+        "Failed to truncate reflinked slice to %luB. %s",
+        byteCount, strerror(errno)
+    );
+    lseek(destFd, byteCount, SEEK_SET);
+    countSyscall(0);
+    return true;
+}
+
+/**
+ * Copies byteCount bytes from byteOffset in srcFd to the current position of
+ * destFd using copy_file_range() or sendfile(), depending on method.
+ * Returns false, without having copied anything, if method isn't supported
+ * for this pair of files.
+ */
+bool spliceSlice(
+    int srcFd, int destFd, enum copyMethod method,
+    size_t byteOffset, size_t byteCount
+){
+    loff_t inOffset = byteOffset, outOffset = 0;
+    size_t copied = 0;
+
+    while(copied < byteCount){
+        ssize_t ret;
+
+        if(method == COPY_RANGE) ret = copy_file_range(
+            srcFd, &inOffset, destFd, &outOffset, byteCount - copied, 0
+        );
+        else ret = sendfile(destFd, srcFd, &inOffset, byteCount - copied);
+        countSyscall(ret > 0 ? ret : 0);
+
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            if(copied == 0 && isCopyUnsupported(errno)) return false;
+            throwError(
+                "Failed to copy slice with %s. Current offset: %luB. %s",
+                copyMethodNames[method], byteOffset + copied, strerror(errno)
+            );
+        }
+        if(ret == 0) throwError(
+            "Unexpected end of input. Current offset: %luB",
+            byteOffset + copied
+        );
+
+        copied += ret;
+    }
+
+    return true;
+}
+
+/**
+ * Gets this thread's copy buffer, of COPY_BUFFER_SIZE bytes. Each thread keeps
+ * its buffer for the life of the process, so that it's allocated once per
+ * batch rather than once per slice, and isn't leaked when throwError()
+ * unwinds past its user.
+ */
+void *getCopyBuffer(void){
+    static __thread void *buffer = NULL;
+
+    if(!buffer && !(buffer = malloc(COPY_BUFFER_SIZE))) throwError(
+        "Failed to allocate buffer of %uB. %s",
+        COPY_BUFFER_SIZE, strerror(errno)
+    );
+    return buffer;
+}
+
+/**
+ * Writes all byteCount bytes of data to destFd at destOffset.
+ */
+void writeAt(
+    int destFd, const void *data, size_t byteCount, size_t destOffset
+){
+    size_t written = 0;
+
+    while(written < byteCount){
+        ssize_t ret = pwrite(
+            destFd, (const char*)data + written, byteCount - written,
+            destOffset + written
+        );
+        countSyscall(ret > 0 ? ret : 0);
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            throwError("Failed to write to file. %s", strerror(errno));
+        }
+        written += ret;
+    }
+}
+
+// Sparse slices are written in blocks of this many bytes, of which those
+// that are all zeros are left as holes
+#define SPARSE_BLOCK_SIZE 4096
+
+/**
+ * Returns true if all size bytes of data are zero. This is compiled to
+ * whatever SIMD the target has, and on x86, AVX2 is used where available.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+bool isZeroBlock(const uint8_t *data, size_t size){
+    typedef uint64_t vector __attribute__((vector_size(32)));
+    vector acc = { 0 }, chunk;
+    uint64_t rest = 0;
+    size_t i = 0;
+
+    for(; i + sizeof(vector) <= size; i += sizeof(vector)){
+        memcpy(&chunk, data + i, sizeof(chunk));
+        acc |= chunk;
+    }
+    for(; i < size; i++) rest |= data[i];
+
+    return !(acc[0] | acc[1] | acc[2] | acc[3] | rest);
+}
+
+/**
+ * As writeAt(), but leaves blocks that are all zeros as holes in destFd,
+ * rather than writing them. destFd must not already have data there, and
+ * must be extended to its full size with ftruncate() once it's written.
+ * destOffset should be a multiple of SPARSE_BLOCK_SIZE.
+ * Returns the number of bytes that were left as holes.
+ */
+size_t writeSparseAt(
+    int destFd, const uint8_t *data, size_t byteCount, size_t destOffset
+){
+    size_t holes = 0, runStart = 0;
+
+    for(size_t i = 0; i < byteCount; i += SPARSE_BLOCK_SIZE){
+        size_t blockSize = byteCount - i < SPARSE_BLOCK_SIZE
+            ? byteCount - i : SPARSE_BLOCK_SIZE;
+
+        if(!isZeroBlock(data + i, blockSize)) continue;
+
+        // Write out the run of data blocks before this hole in one go
+        if(i > runStart) writeAt(
+            destFd, data + runStart, i - runStart, destOffset + runStart
+        );
+        runStart = i + blockSize;
+        holes += blockSize;
+    }
+    if(byteCount > runStart) writeAt(
+        destFd, data + runStart, byteCount - runStart, destOffset + runStart
+    );
+
+    return holes;
+}
+
+/**
+ * Copies byteCount bytes from byteOffset in srcFd to the start of destFd
+ * through a userspace buffer. Works for any pair of files.
+ */
+void bufferSlice(int srcFd, int destFd, size_t byteOffset, size_t byteCount){
+    void *buffer = getCopyBuffer();
+    size_t copied = 0;
+
+    while(copied < byteCount){
+        size_t quota = byteCount - copied;
+        ssize_t ret;
+
+        if(quota > COPY_BUFFER_SIZE) quota = COPY_BUFFER_SIZE;
+
+        ret = pread(srcFd, buffer, quota, byteOffset + copied);
+        countSyscall(ret > 0 ? ret : 0);
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            throwError(
+                "Failed to read file. Current offset: %luB. %s",
+                byteOffset + copied, strerror(errno)
+            );
+        }
+        if(ret == 0) throwError(
+            "Unexpected end of input. Current offset: %luB",
+            byteOffset + copied
+        );
+
+        writeAt(destFd, buffer, ret, copied);
+        copied += ret;
+    }
+}
+
+/**
+ * Writes a slice straight out of a mapped image to the start of destFile,
+ * with no intermediate buffer.
+ */
+void writeMappedSlice(
+    const imageMap *map, FILE *destFile, size_t byteOffset, size_t byteCount
+){
+    if(byteOffset + byteCount > map->size) throwError(
+        "Unexpected end of input. Current offset: %luB", map->size
+    );
+
+    fflush(destFile);
+    writeAt(fileno(destFile), map->data + byteOffset, byteCount, 0);
+}
+
+/**
+ * Reads exactly byteCount bytes from the current position of the stream
+ * srcFd into buffer. streamOffset is only used for error messages.
+ */
+void readStream(
+    int srcFd, void *buffer, size_t byteCount, size_t streamOffset
+){
+    size_t got = 0;
+
+    while(got < byteCount){
+        ssize_t ret = read(srcFd, (char*)buffer + got, byteCount - got);
+        countSyscall(ret > 0 ? ret : 0);
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            throwError(
+                "Failed to read stream. Current offset: %luB. %s",
+                streamOffset + got, strerror(errno)
+            );
+        }
+        if(ret == 0) throwError(
+            "Unexpected end of input. Current offset: %luB",
+            streamOffset + got
+        );
+        got += ret;
+    }
+}
+
+/**
+ * Reads and validates the header from the start of the stream srcFd into
+ * header, using buffer to hold it. Only a prefix common to every header
+ * version is read at first, so that the rest can be read once the version
+ * is known, without reading past the end of the header.
+ * Returns the number of bytes that were read from srcFd.
+ */
+size_t readStreamHeader(
+    bootHeader *header, uint8_t buffer[MAX_HEADER_SIZE], int srcFd
+){
+    const headerLayout *layout;
+    const char *error = NULL;
+    size_t size = HEADER_PREFIX_SIZE;
+
+    readStream(srcFd, buffer, size, 0);
+    layout = findHeaderLayout(buffer, size, &error);
+    if(!layout) throwError("%s", error);
+    if(layout->size > size){
+        readStream(srcFd, buffer + size, layout->size - size, size);
+        size = layout->size;
+    }
+
+    validateHeader(header, buffer, size);
+    return size;
+}
+
+/**
+ * Reads and discards byteCount bytes (eg. page padding) from the stream srcFd.
+ */
+void skipStream(int srcFd, size_t byteCount, size_t streamOffset){
+    void *buffer = getCopyBuffer();
+
+    while(byteCount){
+        size_t quota = byteCount < COPY_BUFFER_SIZE
+            ? byteCount : COPY_BUFFER_SIZE;
+        readStream(srcFd, buffer, quota, streamOffset);
+        streamOffset += quota;
+        byteCount -= quota;
+    }
+}
+
+/**
+ * Copies the next byteCount bytes of the stream srcFd to the start of
+ * destFile. Pipes are spliced straight into destFile; anything else goes
+ * through a buffer.
+ * Returns the method that was used.
+ */
+enum copyMethod streamSlice(
+    int srcFd, FILE *destFile, size_t byteCount, size_t streamOffset
+){
+    int destFd = fileno(destFile);
+    loff_t outOffset = 0;
+    void *buffer;
+
+    fflush(destFile);
+    while((size_t)outOffset < byteCount){
+        ssize_t ret = splice(
+            srcFd, NULL, destFd, &outOffset, byteCount - outOffset,
+            SPLICE_F_MOVE | SPLICE_F_MORE
+        );
+        countSyscall(ret > 0 ? ret : 0);
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            if(outOffset == 0 && isCopyUnsupported(errno)) break;
+            throwError(
+                "Failed to splice stream. Current offset: %luB. %s",
+                streamOffset + outOffset, strerror(errno)
+            );
+        }
+        if(ret == 0) throwError(
+            "Unexpected end of input. Current offset: %luB",
+            streamOffset + outOffset
+        );
+    }
+    if(outOffset) return COPY_SPLICE;
+
+    buffer = getCopyBuffer();
+    for(size_t copied = 0; copied < byteCount;){
+        size_t quota = byteCount - copied < COPY_BUFFER_SIZE
+            ? byteCount - copied : COPY_BUFFER_SIZE;
+        readStream(srcFd, buffer, quota, streamOffset + copied);
+        writeAt(destFd, buffer, quota, copied);
+        copied += quota;
+    }
+    return COPY_BUFFERED;
+}
+
+/**
+ * Returns true if srcFile can't be seeked through (eg. it's a pipe), and so
+ * can only be extracted from in a single front-to-back pass.
+ */
+bool isStream(FILE *srcFile){
+    struct stat srcStat;
+
+    if(fstat(fileno(srcFile), &srcStat)) throwError(
+        "Failed to stat source image. %s", strerror(errno)
+    );
+    countSyscall(0);
+    return !S_ISREG(srcStat.st_mode) && !S_ISBLK(srcStat.st_mode);
+}
+
+/**
+ * Extracts a slice of srcFile into destFile, using only positional I/O on
+ * srcFile so that several slices can be extracted from it at once. The
+ * cheapest copy method is tried first: a reflink, then an in-kernel
+ * copy_file_range() or sendfile(), and only then a plain buffered copy.
+ * Returns the method that was ultimately used.
+ */
+enum copyMethod writeSlice(
+    FILE *srcFile, FILE *destFile, size_t byteOffset, size_t byteCount
+){
+    int srcFd = fileno(srcFile), destFd = fileno(destFile);
+
+    // Make sure nothing buffered in destFile ends up after the slice
+    fflush(destFile);
+
+    if(cloneSlice(srcFd, destFd, byteOffset, byteCount))
+        return COPY_REFLINK;
+    if(spliceSlice(srcFd, destFd, COPY_RANGE, byteOffset, byteCount))
+        return COPY_RANGE;
+    if(spliceSlice(srcFd, destFd, COPY_SENDFILE, byteOffset, byteCount))
+        return COPY_SENDFILE;
+
+    bufferSlice(srcFd, destFd, byteOffset, byteCount);
+    return COPY_BUFFERED;
+}
+
+enum ramdiskFormat {
+    RAMDISK_UNKNOWN,
+    RAMDISK_CPIO,
+    RAMDISK_GZIP,
+    RAMDISK_LZ4,
+    RAMDISK_XZ,
+    RAMDISK_LZMA
+};
+
+const char *ramdiskFormatNames[] = { //see ramdiskFormat
+    "unknown",
+    "cpio",
+    "gzip",
+    "lz4 legacy",
+    "xz",
+    "lzma"
+};
+
+// How the remake script recompresses an unpacked ramdisk
+const char *ramdiskCompressCmds[] = { //see ramdiskFormat
+    "cat",
+    "cat",
+    "gzip -9n",
+    "lz4 -l -12",
+    "xz --check=crc32 -9",
+    "lzma -9"
+};
+
+#define LZ4_LEGACY_MAGIC 0x184C2102
+#define LZ4_LEGACY_BLOCK_SIZE (8 * 1024 * 1024)
+#define LZ4_LEGACY_BOUND \
+    (LZ4_LEGACY_BLOCK_SIZE + LZ4_LEGACY_BLOCK_SIZE / 255 + 16)
+
+#define CPIO_HEADER_SIZE 110
+#define CPIO_TRAILER "TRAILER!!!"
+
+/**
+ * Sniffs the compression of a ramdisk from its first few bytes.
+ */
+enum ramdiskFormat getRamdiskFormat(const uint8_t *data, size_t size){
+    if(size >= 6 && (
+        memcmp(data, "070701", 6) == 0 || memcmp(data, "070702", 6) == 0
+    )) return RAMDISK_CPIO;
+    if(size >= 2 && data[0] == 0x1f && data[1] == 0x8b) return RAMDISK_GZIP;
+    if(size >= 4 && (
+        data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24
+    ) == LZ4_LEGACY_MAGIC) return RAMDISK_LZ4;
+    if(size >= 6 && memcmp(data, "\xfd" "7zXZ\0", 6) == 0) return RAMDISK_XZ;
+    if(size >= 3 && data[0] == 0x5d && data[1] == 0 && data[2] == 0)
+        return RAMDISK_LZMA;
+    return RAMDISK_UNKNOWN;
+}
+
+/**
+ * Decompresses a single LZ4 block of srcSize bytes into dest.
+ * Returns the decompressed size, or -1 if the block is malformed or wouldn't
+ * fit in destSize bytes.
+ */
+ssize_t decodeLz4Block(
+    const uint8_t *src, size_t srcSize, uint8_t *dest, size_t destSize
+){
+    const uint8_t *in = src, *inEnd = src + srcSize;
+    uint8_t *out = dest, *outEnd = dest + destSize;
+
+    while(in < inEnd){
+        unsigned token = *in++;
+        size_t literals = token >> 4, matchLen = token & 15, matchOffset;
+        const uint8_t *match;
+        uint8_t b;
+
+        if(literals == 15) do{
+            if(in >= inEnd) return -1;
+            literals += b = *in++;
+        }while(b == 255);
+        if(literals > (size_t)(inEnd - in) || literals > (size_t)(outEnd - out))
+            return -1;
+        memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+
+        // The last sequence of a block is only literals
+        if(in == inEnd) break;
+
+        if(inEnd - in < 2) return -1;
+        matchOffset = in[0] | in[1] << 8;
+        in += 2;
+        if(matchOffset == 0 || matchOffset > (size_t)(out - dest)) return -1;
+
+        if(matchLen == 15) do{
+            if(in >= inEnd) return -1;
+            matchLen += b = *in++;
+        }while(b == 255);
+        matchLen += 4;
+        if(matchLen > (size_t)(outEnd - out)) return -1;
+
+        // Matches may overlap what they're producing, in which case they
+        // have to be copied a byte at a time
+        match = out - matchOffset;
+        if(matchOffset >= matchLen) memcpy(out, match, matchLen);
+        else for(size_t i = 0; i < matchLen; i++) out[i] = match[i];
+        out += matchLen;
+    }
+
+    return out - dest;
+}
+
+/**
+ * Incremental reader for the newc cpio archives that mkbootfs produces,
+ * which creates each entry under dirFd as soon as its bytes arrive.
+ */
+typedef struct {
+    int dirFd;
+    int entryDirFd; // directory of the current entry, if not dirFd itself
+    const char *baseName; // last component of name
+    enum {
+        CPIO_HEADER, CPIO_NAME, CPIO_NAME_PADDING,
+        CPIO_DATA, CPIO_DATA_PADDING, CPIO_END
+    } stage;
+    uint8_t header[CPIO_HEADER_SIZE];
+    char name[PATH_MAX], link[PATH_MAX];
+    size_t stageLen, stageDone; // bytes in, and bytes read of, this stage
+    size_t offset; // bytes read of the whole archive, for alignment
+    uint32_t mode, rdevMajor, rdevMinor;
+    int fileFd;
+    bool skip;
+    size_t entries;
+} cpioReader;
+
+uint32_t parseCpioField(const uint8_t *header, int field){
+    char hex[9];
+    char *end;
+    uint32_t value;
+
+    // Each field after the magic is 8 hex digits
+    memcpy(hex, header + 6 + field * 8, 8);
+    hex[8] = '\0';
+    value = strtoul(hex, &end, 16);
+    if(*end != '\0') throwError("Invalid cpio header field \"%s\"", hex);
+    return value;
+}
+
+/**
+ * Returns true if name stays within the directory being unpacked into.
+ */
+bool isSafeCpioName(const char *name){
+    if(name[0] == '/') return false;
+    for(const char *part = name; part; part = strchr(part, '/')){
+        if(*part == '/') part++;
+        if(strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0'))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Opens the directory that cpio's current entry is in, one component at a
+ * time without following symlinks, so that a symlink unpacked earlier can't
+ * lead later entries out of cpio->dirFd. Sets cpio->entryDirFd, or leaves it
+ * at -1 for entries directly in cpio->dirFd, and points cpio->baseName at
+ * the last component of the name. Returns false, with errno set, if a
+ * component isn't a directory.
+ */
+bool openCpioEntryDir(cpioReader *cpio){
+    char *name = cpio->name;
+    char *base = strrchr(name, '/');
+    int fd = cpio->dirFd;
+
+    cpio->baseName = base ? base + 1 : name;
+    for(char *part = name; base && part < base;){
+        char *end = strchr(part, '/');
+        int next;
+
+        *end = '\0';
+        if(*part && strcmp(part, ".") != 0){
+            next = openat(
+                fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC
+            );
+            if(fd != cpio->dirFd) close(fd);
+            fd = next;
+        }
+        *end = '/';
+        if(fd < 0) return false;
+        part = end + 1;
+    }
+    cpio->entryDirFd = fd == cpio->dirFd ? -1 : fd;
+    return true;
+}
+
+/**
+ * Creates the entry just read by cpio, other than the data of regular files
+ * and symlinks, which is still to come.
+ */
+void createCpioEntry(cpioReader *cpio){
+    uint32_t perms = cpio->mode & 07777;
+    const char *name = cpio->name;
+    const char *base;
+    int dirFd, fd;
+    size_t len = strlen(cpio->name);
+
+    cpio->skip = true;
+    while(len > 1 && cpio->name[len - 1] == '/') cpio->name[--len] = '\0';
+    if(strcmp(name, ".") == 0 || strcmp(name, "") == 0) return;
+    if(!isSafeCpioName(name)){
+        throwWarning("Skipping unsafe ramdisk entry \"%s\"", name);
+        return;
+    }
+    if(!openCpioEntryDir(cpio)){
+        if(errno != ELOOP && errno != ENOTDIR) throwError(
+            "Failed to open the directory of ramdisk entry \"%s\". %s",
+            name, strerror(errno)
+        );
+        throwWarning(
+            "Skipping ramdisk entry \"%s\" under a symlink or file", name
+        );
+        errno = 0;
+        return;
+    }
+    dirFd = cpio->entryDirFd >= 0 ? cpio->entryDirFd : cpio->dirFd;
+    base = cpio->baseName;
+
+    // Replace whatever a previous unpack left here, other than directories
+    if(!S_ISDIR(cpio->mode)) unlinkat(dirFd, base, 0);
+
+    errno = 0;
+    switch(cpio->mode & S_IFMT){
+        case S_IFDIR:
+            // Keep directories writable by us, so they can be filled in.
+            // An existing one is opened rather than chmodded by name, so a
+            // symlink left in its place isn't followed.
+            if(mkdirat(dirFd, base, perms | 0700) && errno == EEXIST){
+                errno = 0;
+                fd = openat(
+                    dirFd, base,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC
+                );
+                if(fd >= 0){
+                    fchmod(fd, perms | 0700);
+                    close(fd);
+                }
+            }
+            break;
+        case S_IFREG:
+            cpio->fileFd = openat(
+                dirFd, base,
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, perms
+            );
+            if(cpio->fileFd >= 0){
+                fchmod(cpio->fileFd, perms);
+                cpio->skip = false;
+            }
+            break;
+        case S_IFLNK:
+            cpio->skip = false;
+            break;
+        default:
+            // Device nodes, fifos and sockets. Device nodes need privileges,
+            // so failing to create them is only worth a warning.
+            if(mknodat(
+                dirFd, base, cpio->mode,
+                makedev(cpio->rdevMajor, cpio->rdevMinor)
+            )){
+                throwWarning(
+                    "Failed to create ramdisk node \"%s\". %s",
+                    name, strerror(errno)
+                );
+                errno = 0;
+            }
+    }
+    if(errno) throwError(
+        "Failed to create ramdisk entry \"%s\". %s", name, strerror(errno)
+    );
+}
+
+/**
+ * Finishes the entry whose data cpio just finished reading.
+ */
+void finishCpioEntry(cpioReader *cpio){
+    if(cpio->fileFd >= 0){
+        if(close(cpio->fileFd)) throwError(
+            "Failed to write ramdisk entry \"%s\". %s",
+            cpio->name, strerror(errno)
+        );
+        cpio->fileFd = -1;
+    }else if(!cpio->skip && S_ISLNK(cpio->mode)){
+        cpio->link[cpio->stageLen] = '\0';
+        if(symlinkat(
+            cpio->link,
+            cpio->entryDirFd >= 0 ? cpio->entryDirFd : cpio->dirFd,
+            cpio->baseName
+        )) throwError(
+            "Failed to create ramdisk symlink \"%s\". %s",
+            cpio->name, strerror(errno)
+        );
+    }
+    if(cpio->entryDirFd >= 0) close(cpio->entryDirFd);
+    cpio->entryDirFd = -1;
+    cpio->entries++;
+}
+
+/**
+ * Moves cpio on to stage, which will be stageLen bytes long.
+ */
+void setCpioStage(cpioReader *cpio, int stage, size_t stageLen){
+    cpio->stage = stage;
+    cpio->stageLen = stageLen;
+    cpio->stageDone = 0;
+}
+
+/**
+ * Feeds the next size bytes of a cpio archive to cpio. As with the kernel,
+ * another archive can follow the trailer, after any zero padding.
+ */
+void feedCpio(cpioReader *cpio, const uint8_t *data, size_t size){
+    // Stages can be empty, so keep going while there's a stage to finish,
+    // even if there's no data left for it
+    while(size || (
+        cpio->stage != CPIO_END && cpio->stageDone == cpio->stageLen
+    )){
+        size_t quota = cpio->stageLen - cpio->stageDone;
+        uint8_t *dest = NULL;
+
+        if(cpio->stage == CPIO_END){
+            if(!*data){
+                data++;
+                size--;
+                cpio->offset++;
+                continue;
+            }
+            setCpioStage(cpio, CPIO_HEADER, CPIO_HEADER_SIZE);
+            quota = CPIO_HEADER_SIZE;
+        }
+
+        if(quota > size) quota = size;
+        switch(cpio->stage){
+            case CPIO_HEADER: dest = cpio->header; break;
+            case CPIO_NAME: dest = (uint8_t*)cpio->name; break;
+            case CPIO_DATA:
+                if(cpio->skip) break;
+                if(cpio->fileFd >= 0) writeAt(
+                    cpio->fileFd, data, quota, cpio->stageDone
+                );
+                else dest = (uint8_t*)cpio->link;
+                break;
+            default: break;
+        }
+        if(dest) memcpy(dest + cpio->stageDone, data, quota);
+        cpio->stageDone += quota;
+        cpio->offset += quota;
+        data += quota;
+        size -= quota;
+        if(cpio->stageDone < cpio->stageLen) continue;
+
+        // This stage is complete, so work out what comes next
+        switch(cpio->stage){
+            case CPIO_HEADER: {
+                uint32_t nameSize;
+
+                if(memcmp(cpio->header, "070701", 6) != 0
+                    && memcmp(cpio->header, "070702", 6) != 0
+                ) throwError(
+                    "Invalid cpio magic at offset %luB",
+                    cpio->offset - CPIO_HEADER_SIZE
+                );
+                cpio->mode = parseCpioField(cpio->header, 1);
+                cpio->rdevMajor = parseCpioField(cpio->header, 9);
+                cpio->rdevMinor = parseCpioField(cpio->header, 10);
+                nameSize = parseCpioField(cpio->header, 11);
+                if(nameSize == 0 || nameSize > PATH_MAX) throwError(
+                    "Invalid cpio name size %uB", nameSize
+                );
+                setCpioStage(cpio, CPIO_NAME, nameSize);
+                break;
+            }
+            case CPIO_NAME: {
+                uint32_t fileSize = parseCpioField(cpio->header, 6);
+
+                cpio->name[cpio->stageLen - 1] = '\0';
+                if(strcmp(cpio->name, CPIO_TRAILER) == 0){
+                    setCpioStage(cpio, CPIO_END, 0);
+                    break;
+                }
+                if(S_ISLNK(cpio->mode) && fileSize >= PATH_MAX) throwError(
+                    "Invalid cpio symlink size %uB", fileSize
+                );
+                createCpioEntry(cpio);
+
+                // Data starts on the next 4 byte boundary
+                setCpioStage(
+                    cpio, CPIO_NAME_PADDING, (4 - cpio->offset % 4) % 4
+                );
+                break;
+            }
+            case CPIO_NAME_PADDING:
+                setCpioStage(cpio, CPIO_DATA, parseCpioField(cpio->header, 6));
+                break;
+            case CPIO_DATA:
+                finishCpioEntry(cpio);
+
+                // The next header starts on the next 4 byte boundary
+                setCpioStage(
+                    cpio, CPIO_DATA_PADDING, (4 - cpio->offset % 4) % 4
+                );
+                break;
+            case CPIO_DATA_PADDING:
+                setCpioStage(cpio, CPIO_HEADER, CPIO_HEADER_SIZE);
+                break;
+            default: break;
+        }
+    }
+}
+
+/**
+ * Decompresses a ramdisk as its bytes arrive, and unpacks the resulting cpio
+ * archive as it's decompressed, so that no intermediate files are needed.
+ */
+typedef struct {
+    enum ramdiskFormat format;
+    bool started, finished;
+    z_stream gzip;
+    lzma_stream xz;
+    uint8_t *outBuffer;
+    size_t outSize;
+    uint8_t *lz4Block; // compressed lz4 block, including its size word
+    size_t lz4BlockLen, lz4BlockSize;
+    cpioReader cpio;
+} ramdiskUnpacker;
+
+void initRamdiskUnpacker(ramdiskUnpacker *ramdisk, int dirFd){
+    memset(ramdisk, 0, sizeof(*ramdisk));
+    ramdisk->cpio.dirFd = dirFd;
+    ramdisk->cpio.fileFd = ramdisk->cpio.entryDirFd = -1;
+    setCpioStage(&ramdisk->cpio, CPIO_HEADER, CPIO_HEADER_SIZE);
+}
+
+void releaseRamdiskUnpacker(ramdiskUnpacker *ramdisk){
+    if(ramdisk->started) switch(ramdisk->format){
+        case RAMDISK_GZIP: inflateEnd(&ramdisk->gzip); break;
+        case RAMDISK_XZ: case RAMDISK_LZMA: lzma_end(&ramdisk->xz); break;
+        default: break;
+    }
+    if(ramdisk->cpio.fileFd >= 0) close(ramdisk->cpio.fileFd);
+    if(ramdisk->cpio.entryDirFd >= 0) close(ramdisk->cpio.entryDirFd);
+    if(ramdisk->cpio.dirFd >= 0) close(ramdisk->cpio.dirFd);
+    free(ramdisk->outBuffer);
+    free(ramdisk->lz4Block);
+    memset(ramdisk, 0, sizeof(*ramdisk));
+    ramdisk->cpio.dirFd = ramdisk->cpio.fileFd = -1;
+    ramdisk->cpio.entryDirFd = -1;
+}
+
+void startRamdiskUnpacker(
+    ramdiskUnpacker *ramdisk, const uint8_t *data, size_t size
+){
+    lzma_stream xzInit = LZMA_STREAM_INIT;
+    int ret = 0;
+
+    ramdisk->format = getRamdiskFormat(data, size);
+    switch(ramdisk->format){
+        case RAMDISK_UNKNOWN:
+            throwError("Unrecognised ramdisk compression");
+        case RAMDISK_GZIP:
+            if((ret = inflateInit2(&ramdisk->gzip, 15 + 16)) != Z_OK)
+                throwError("Failed to start gzip decompression (%d)", ret);
+            break;
+        case RAMDISK_XZ: case RAMDISK_LZMA:
+            ramdisk->xz = xzInit;
+            if((ret = lzma_auto_decoder(&ramdisk->xz, UINT64_MAX, 0))
+                != LZMA_OK
+            ) throwError("Failed to start xz decompression (%d)", ret);
+            break;
+        case RAMDISK_LZ4:
+            ramdisk->lz4BlockSize = sizeof(uint32_t) + LZ4_LEGACY_BOUND;
+            if(!(ramdisk->lz4Block = malloc(ramdisk->lz4BlockSize)))
+                throwError("Failed to allocate lz4 block. %s", strerror(errno));
+            break;
+        default: break;
+    }
+    ramdisk->started = true;
+
+    ramdisk->outSize = ramdisk->format == RAMDISK_LZ4
+        ? LZ4_LEGACY_BLOCK_SIZE : COPY_BUFFER_SIZE;
+    if(ramdisk->format != RAMDISK_CPIO
+        && !(ramdisk->outBuffer = malloc(ramdisk->outSize))
+    ) throwError(
+        "Failed to allocate decompression buffer. %s", strerror(errno)
+    );
+}
+
+/**
+ * Feeds the next size bytes of an lz4 legacy stream to ramdisk, which is made
+ * up of independent blocks, each preceded by its compressed size.
+ * Returns the number of bytes used, which is less than size if the end of
+ * the compressed data was reached.
+ */
+size_t feedLz4(ramdiskUnpacker *ramdisk, const uint8_t *data, size_t size){
+    size_t used = 0;
+
+    while(used < size && !ramdisk->finished){
+        uint8_t *block = ramdisk->lz4Block;
+        size_t want = sizeof(uint32_t), quota;
+        uint32_t blockSize = 0;
+
+        if(ramdisk->lz4BlockLen >= sizeof(uint32_t)){
+            blockSize = block[0] | block[1] << 8 | block[2] << 16
+                | (uint32_t)block[3] << 24;
+            want += blockSize;
+        }
+
+        quota = want - ramdisk->lz4BlockLen;
+        if(quota > size - used) quota = size - used;
+        memcpy(block + ramdisk->lz4BlockLen, data + used, quota);
+        ramdisk->lz4BlockLen += quota;
+        used += quota;
+        if(ramdisk->lz4BlockLen < want) continue;
+
+        if(want == sizeof(uint32_t)){
+            blockSize = block[0] | block[1] << 8 | block[2] << 16
+                | (uint32_t)block[3] << 24;
+
+            // The magic starts each (possibly concatenated) stream, whereas
+            // a size that couldn't be a block is padding after the last one
+            if(blockSize == LZ4_LEGACY_MAGIC) ramdisk->lz4BlockLen = 0;
+            else if(blockSize == 0 || blockSize > LZ4_LEGACY_BOUND){
+                ramdisk->finished = true;
+                used -= quota;
+            }
+            continue;
+        }
+
+        ssize_t outLen = decodeLz4Block(
+            block + sizeof(uint32_t), blockSize,
+            ramdisk->outBuffer, ramdisk->outSize
+        );
+        if(outLen < 0) throwError("Invalid lz4 block in ramdisk");
+        feedCpio(&ramdisk->cpio, ramdisk->outBuffer, outLen);
+        ramdisk->lz4BlockLen = 0;
+    }
+
+    return used;
+}
+
+/**
+ * Readies ramdisk for another compressed stream, once the last one ended.
+ * Returns false if the format can't be concatenated like this.
+ */
+bool restartRamdiskUnpacker(ramdiskUnpacker *ramdisk){
+    int ret;
+
+    switch(ramdisk->format){
+        case RAMDISK_GZIP:
+            if((ret = inflateReset(&ramdisk->gzip)) != Z_OK)
+                throwError("Failed to restart gzip decompression (%d)", ret);
+            break;
+        case RAMDISK_XZ: case RAMDISK_LZMA:
+            if((ret = lzma_auto_decoder(&ramdisk->xz, UINT64_MAX, 0))
+                != LZMA_OK
+            ) throwError("Failed to restart xz decompression (%d)", ret);
+            break;
+        default: return false;
+    }
+    ramdisk->finished = false;
+    return true;
+}
+
+/**
+ * Feeds the next size bytes of a compressed ramdisk to ramdisk.
+ */
+void feedRamdisk(ramdiskUnpacker *ramdisk, const uint8_t *data, size_t size){
+    if(!ramdisk->started) startRamdiskUnpacker(ramdisk, data, size);
+    if(ramdisk->finished){
+        // Another stream can follow the last one, after any zero padding,
+        // as the kernel allows
+        while(size && !*data){
+            data++;
+            size--;
+        }
+        if(!size || !restartRamdiskUnpacker(ramdisk)) return;
+    }
+
+    switch(ramdisk->format){
+        case RAMDISK_CPIO:
+            feedCpio(&ramdisk->cpio, data, size);
+            break;
+        case RAMDISK_GZIP: {
+            z_stream *gzip = &ramdisk->gzip;
+
+            gzip->next_in = (uint8_t*)data;
+            gzip->avail_in = size;
+            do{
+                int ret;
+
+                gzip->next_out = ramdisk->outBuffer;
+                gzip->avail_out = ramdisk->outSize;
+                ret = inflate(gzip, Z_NO_FLUSH);
+                if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                    throwError(
+                        "Failed to decompress gzip ramdisk. %s",
+                        gzip->msg ? gzip->msg : "Corrupt data"
+                    );
+                feedCpio(
+                    &ramdisk->cpio, ramdisk->outBuffer,
+                    ramdisk->outSize - gzip->avail_out
+                );
+
+                if(ret == Z_STREAM_END){
+                    // Start on the stream after this one, if there is one
+                    ramdisk->finished = true;
+                    if(gzip->avail_in) feedRamdisk(
+                        ramdisk, gzip->next_in, gzip->avail_in
+                    );
+                    break;
+                }
+                if(ret == Z_BUF_ERROR) break;
+            }while(gzip->avail_in || gzip->avail_out == 0);
+            break;
+        }
+        case RAMDISK_XZ: case RAMDISK_LZMA: {
+            lzma_stream *xz = &ramdisk->xz;
+
+            xz->next_in = data;
+            xz->avail_in = size;
+            do{
+                lzma_ret ret;
+
+                xz->next_out = ramdisk->outBuffer;
+                xz->avail_out = ramdisk->outSize;
+                ret = lzma_code(xz, LZMA_RUN);
+                if(ret != LZMA_OK && ret != LZMA_STREAM_END
+                    && ret != LZMA_BUF_ERROR
+                ) throwError("Failed to decompress xz ramdisk (%d)", ret);
+                feedCpio(
+                    &ramdisk->cpio, ramdisk->outBuffer,
+                    ramdisk->outSize - xz->avail_out
+                );
+
+                if(ret == LZMA_STREAM_END){
+                    // Start on the stream after this one, if there is one
+                    ramdisk->finished = true;
+                    if(xz->avail_in) feedRamdisk(
+                        ramdisk, xz->next_in, xz->avail_in
+                    );
+                    break;
+                }
+                if(ret == LZMA_BUF_ERROR) break;
+            }while(xz->avail_in || xz->avail_out == 0);
+            break;
+        }
+        case RAMDISK_LZ4:
+            feedLz4(ramdisk, data, size);
+            break;
+        default: break;
+    }
+}
+
+/**
+ * Called once the whole ramdisk has been fed to ramdisk, to check that it
+ * contained a complete archive.
+ */
+void finishRamdisk(ramdiskUnpacker *ramdisk){
+    if(ramdisk->format == RAMDISK_LZ4 && !ramdisk->finished
+        && ramdisk->lz4BlockLen >= sizeof(uint32_t)
+    )
+        throwError("Ramdisk ends part way through an lz4 block");
+    if(ramdisk->format != RAMDISK_CPIO && ramdisk->format != RAMDISK_LZ4
+        && !ramdisk->finished
+    ) throwError("Ramdisk ends part way through its compressed data");
+    if(ramdisk->cpio.stage != CPIO_END) throwWarning(
+        "Ramdisk ends without a cpio trailer, after %zu entries",
+        ramdisk->cpio.entries
+    );
+}
+
+/**
+ * Builds an Android sparse image of a slice as it's extracted, with runs of
+ * blocks that repeat a single 32 bit value (eg. zeros) as fill chunks. Data
+ * chunks refer back to the source image rather than being copied: into the
+ * mapping if there is one, or else to srcFd. Only slices read from a stream
+ * have to be held in memory until the sparse image is written.
+ */
+typedef struct {
+    struct sparse_file *file;
+    const imageMap *map; // data chunks point into this, if set
+    int srcFd; // or else refer to this, unless it's a stream
+    uint32_t srcOffset; // of the slice in srcFd
+    void **buffers; // data held on to from a stream
+    size_t buffersLen, buffersSize;
+    uint32_t fills; // bytes of the slice in fill chunks
+} simgWriter;
+
+void initSimgWriter(
+    simgWriter *simg, uint32_t size,
+    const imageMap *map, int srcFd, uint32_t srcOffset
+){
+    *simg = (simgWriter){
+        .map = map, .srcFd = srcFd, .srcOffset = srcOffset
+    };
+    // Sparse images are made of whole blocks, so the last one is padded out
+    // with zeros
+    size = (size + SPARSE_BLOCK_SIZE - 1) / SPARSE_BLOCK_SIZE
+        * SPARSE_BLOCK_SIZE;
+    if(!(simg->file = sparse_file_new(SPARSE_BLOCK_SIZE, size))) throwError(
+        "Failed to create sparse image. %s", strerror(errno)
+    );
+}
+
+void releaseSimgWriter(simgWriter *simg){
+    if(simg->file) sparse_file_destroy(simg->file);
+    for(size_t i = 0; i < simg->buffersLen; i++) free(simg->buffers[i]);
+    free(simg->buffers);
+    *simg = (simgWriter){ .srcFd = -1 };
+}
+
+/**
+ * Returns true if size bytes of data (a multiple of 4) repeat the same
+ * 32 bit value, which is then put in fill.
+ */
+bool isFillBlock(const uint8_t *data, size_t size, uint32_t *fill){
+    memcpy(fill, data, sizeof(*fill));
+
+    // Comparing data with itself, offset by 4 bytes, checks every word
+    return memcmp(data, data + sizeof(*fill), size - sizeof(*fill)) == 0;
+}
+
+/**
+ * Adds size bytes of data, from sliceOffset in the slice, as a data chunk.
+ */
+void addSimgData(
+    simgWriter *simg, const uint8_t *data, size_t size, size_t sliceOffset
+){
+    unsigned int block = sliceOffset / SPARSE_BLOCK_SIZE;
+    int ret;
+
+    if(simg->map) ret = sparse_file_add_data(
+        simg->file, (void*)data, size, block
+    );
+    else if(simg->srcFd >= 0) ret = sparse_file_add_fd(
+        simg->file, simg->srcFd, simg->srcOffset + sliceOffset, size, block
+    );
+    else{
+        void *copy = malloc(size);
+
+        if(simg->buffersLen == simg->buffersSize){
+            size_t buffersSize = simg->buffersSize ? simg->buffersSize * 2 : 16;
+            void **buffers = realloc(
+                simg->buffers, buffersSize * sizeof(void*)
+            );
+            if(buffers){
+                simg->buffers = buffers;
+                simg->buffersSize = buffersSize;
+            }
+        }
+        if(!copy || simg->buffersLen == simg->buffersSize){
+            free(copy);
+            throwError("Failed to allocate %zuB for sparse image", size);
+        }
+        simg->buffers[simg->buffersLen++] = copy;
+
+        memcpy(copy, data, size);
+        ret = sparse_file_add_data(simg->file, copy, size, block);
+    }
+    if(ret < 0) throwError(
+        "Failed to add data to sparse image. %s", strerror(-ret)
+    );
+}
+
+/**
+ * Adds the next chunk of a slice, which starts at sliceOffset, a multiple
+ * of SPARSE_BLOCK_SIZE. Whole blocks that are fills become fill chunks, and
+ * each run of other blocks becomes one data chunk.
+ */
+void feedSimg(
+    simgWriter *simg, const uint8_t *data, size_t size, size_t sliceOffset
+){
+    size_t runStart = 0;
+
+    for(size_t i = 0; i + SPARSE_BLOCK_SIZE <= size; i += SPARSE_BLOCK_SIZE){
+        uint32_t fill;
+        int ret;
+
+        if(!isFillBlock(data + i, SPARSE_BLOCK_SIZE, &fill)) continue;
+
+        if(i > runStart) addSimgData(
+            simg, data + runStart, i - runStart, sliceOffset + runStart
+        );
+        runStart = i + SPARSE_BLOCK_SIZE;
+
+        // Neighbouring fills of the same value are merged by libsparse
+        ret = sparse_file_add_fill(
+            simg->file, fill, SPARSE_BLOCK_SIZE,
+            (sliceOffset + i) / SPARSE_BLOCK_SIZE
+        );
+        if(ret < 0) throwError(
+            "Failed to add fill to sparse image. %s", strerror(-ret)
+        );
+        simg->fills += SPARSE_BLOCK_SIZE;
+    }
+
+    // A partial block at the end of the slice is always kept as data
+    if(size > runStart) addSimgData(
+        simg, data + runStart, size - runStart, sliceOffset + runStart
+    );
+}
+
+/**
+ * Writes the sparse image out to the start of destFd.
+ */
+void finishSimg(simgWriter *simg, int destFd){
+    int ret = sparse_file_write(simg->file, destFd, false, true, false);
+    if(ret < 0) throwError(
+        "Failed to write sparse image. %s", strerror(-ret)
+    );
+}
+
+/**
+ * The extraction cache is a content-addressed store of slices, along with
+ * an index of the images they were extracted from:
+ *   objects/<sha1>: A slice, named after the SHA-1 of its contents
+ *   index/<key>: A cacheRecord for the image identified by key (see
+ *       getCacheKey())
+ * Objects are read-only reflinks or copies of what was extracted, and are
+ * reflinked back out where possible, or else copied, so an image that's
+ * already in the index is extracted without its slices being parsed at all.
+ */
+#define CACHE_RECORD_MAGIC "UMKBIDX1"
+#define CACHE_KEY_SIZE 128
+#define CACHE_OBJECT_SIZE (sizeof("objects/") + SHA1_DIGEST_SIZE * 2)
+
+typedef struct {
+    uint8_t magic[8];
+    uint32_t headerSize; // bytes of header that are valid
+    uint32_t slicesLen;
+    struct {
+        uint32_t offset, size;
+        uint8_t stored; // whether hash is in objects
+        uint8_t hash[SHA1_DIGEST_SIZE];
+    } __attribute__((packed)) slices[MAX_SLICES]; //see sliceMap
+    uint8_t header[MAX_HEADER_SIZE];
+} __attribute__((packed)) cacheRecord;
+
+/**
+ * Opens the cache at cacheDir, creating it if need be.
+ */
+int openCache(const char *cacheDir){
+    int cacheFd = openDir(cacheDir);
+
+    close(openDirAt(cacheFd, "objects"));
+    close(openDirAt(cacheFd, "index"));
+    return cacheFd;
+}
+
+/**
+ * Gets a key that identifies the contents of srcFile for as long as it isn't
+ * modified: its device, inode, size, and modification and change times. The
+ * change time catches writes that restore the modification time (eg. cp -p).
+ * Returns false if srcFile can't be identified like this (ie. it isn't a
+ * regular file).
+ */
+bool getCacheKey(char key[CACHE_KEY_SIZE], FILE *srcFile){
+    struct stat srcStat;
+
+    if(fstat(fileno(srcFile), &srcStat) || !S_ISREG(srcStat.st_mode))
+        return false;
+    snprintf(
+        key, CACHE_KEY_SIZE, "index/%lx-%lx-%lx-%lx.%09lx-%lx.%09lx",
+        (unsigned long)srcStat.st_dev, (unsigned long)srcStat.st_ino,
+        (unsigned long)srcStat.st_size,
+        (unsigned long)srcStat.st_mtim.tv_sec,
+        (unsigned long)srcStat.st_mtim.tv_nsec,
+        (unsigned long)srcStat.st_ctim.tv_sec,
+        (unsigned long)srcStat.st_ctim.tv_nsec
+    );
+    return true;
+}
+
+void getCacheObject(
+    char object[CACHE_OBJECT_SIZE], const uint8_t hash[SHA1_DIGEST_SIZE]
+){
+    int len = snprintf(object, CACHE_OBJECT_SIZE, "objects/");
+
+    for(size_t i = 0; i < SHA1_DIGEST_SIZE; i++)
+        len += snprintf(object + len, CACHE_OBJECT_SIZE - len, "%02x", hash[i]);
+}
+
+/**
+ * Reads the index record for key into record, and points header at the
+ * header within it.
+ * Returns false if there isn't a valid record for key.
+ */
+bool readCacheRecord(
+    cacheRecord *record, bootHeader *header, int cacheFd, const char *key
+){
+    int fd = openat(cacheFd, key, O_RDONLY | O_CLOEXEC);
+    ssize_t ret;
+
+    if(fd < 0) return false;
+    do ret = pread(fd, record, sizeof(*record), 0);
+    while(ret < 0 && errno == EINTR);
+    close(fd);
+
+    return ret == sizeof(*record)
+        && memcmp(record->magic, CACHE_RECORD_MAGIC, sizeof(record->magic)) == 0
+        && record->slicesLen <= MAX_SLICES
+        && !parseHeader(header, record->header, record->headerSize);
+}
+
+/**
+ * Writes record to the index under key, replacing any record that's already
+ * there. Failing to do so isn't fatal, as the cache can always be rebuilt.
+ */
+void writeCacheRecord(
+    const cacheRecord *record, const char *cacheDir, int cacheFd,
+    const char *key
+){
+    char tempPath[PATH_MAX];
+    int fd;
+
+    snprintf(tempPath, sizeof(tempPath), "%s/index/.XXXXXX", cacheDir);
+    if((fd = mkostemp(tempPath, O_CLOEXEC)) < 0){
+        throwWarning("Failed to create index record. %s", strerror(errno));
+        return;
+    }
+    if(write(fd, record, sizeof(*record)) != sizeof(*record)
+        || fsync(fd) || renameat(AT_FDCWD, tempPath, cacheFd, key)
+    ){
+        throwWarning("Failed to write index record. %s", strerror(errno));
+        unlink(tempPath);
+    }
+    close(fd);
+}
+
+/**
+ * Gives destFd its own copy of srcFd, by reflinking it if possible.
+ * Returns the name of the method used, or NULL if it couldn't be copied.
+ */
+const char *copyCacheFile(int srcFd, int destFd){
+    struct stat srcStat;
+
+    if(ioctl(destFd, FICLONE, srcFd) == 0) return "reflink";
+    if(fstat(srcFd, &srcStat)) return NULL;
+    if(!spliceSlice(srcFd, destFd, COPY_RANGE, 0, srcStat.st_size))
+        bufferSlice(srcFd, destFd, 0, srcStat.st_size);
+    return "copy";
+}
+
+/**
+ * Replaces dest in destDirFd with a reflink, or failing that a copy, of
+ * object in cacheFd. Objects are never hard linked out of the store, so
+ * that writing to dest can't change what's cached.
+ * Returns the name of the method used, or NULL if neither worked.
+ */
+const char *linkCacheObject(
+    int cacheFd, const char *object, int destDirFd, const char *dest
+){
+    int objectFd, destFd;
+    const char *method = NULL;
+
+    if(unlinkat(destDirFd, dest, 0) && errno != ENOENT) return NULL;
+
+    objectFd = openat(cacheFd, object, O_RDONLY | O_CLOEXEC);
+    if(objectFd < 0) return NULL;
+    destFd = openat(
+        destDirFd, dest, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666
+    );
+    if(destFd >= 0){
+        method = copyCacheFile(objectFd, destFd);
+        close(destFd);
+        if(!method) unlinkat(destDirFd, dest, 0);
+    }
+    close(objectFd);
+    return method;
+}
+
+/**
+ * Adds the slice that was just extracted to dest in destDirFd to the store
+ * as object, as a read-only reflink or copy of its own. If the store already
+ * has it, dest is replaced with a reflink of that instead where possible, so
+ * that only one copy is kept.
+ * Returns false if the slice couldn't be stored.
+ */
+bool storeCacheObject(
+    int cacheFd, const char *object, int destDirFd, const char *dest
+){
+    char tempObject[CACHE_OBJECT_SIZE + 8];
+    int srcFd, tempFd, objectFd;
+    bool copied;
+
+    srcFd = openat(destDirFd, dest, O_RDONLY | O_CLOEXEC);
+    if(srcFd < 0) return false;
+
+    objectFd = openat(cacheFd, object, O_RDONLY | O_CLOEXEC);
+    if(objectFd >= 0){
+        int destFd = openat(destDirFd, dest, O_WRONLY | O_CLOEXEC);
+
+        if(destFd >= 0){
+            ioctl(destFd, FICLONE, objectFd);
+            close(destFd);
+        }
+        close(objectFd);
+        close(srcFd);
+        return true;
+    }
+
+    snprintf(tempObject, sizeof(tempObject), "%s.%d", object, (int)gettid());
+    tempFd = openat(
+        cacheFd, tempObject, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0444
+    );
+    copied = tempFd >= 0 && copyCacheFile(srcFd, tempFd)
+        && fchmod(tempFd, 0444) == 0;
+    if(tempFd >= 0) close(tempFd);
+    close(srcFd);
+
+    if(copied && renameat(cacheFd, tempObject, cacheFd, object) == 0)
+        return true;
+    unlinkat(cacheFd, tempObject, 0);
+    return false;
+}
+
+/**
+ * Everything that main() parses from the command line, which is shared by
+ * every image that gets extracted.
+ */
+typedef struct {
+    const char *destDir;
+    const char *dests[2]; //see destsIndex
+    const char *mkbootimgCmd;
+    const char *ramdiskDir; // unpack the ramdisk here, if set
+    const char *cacheDir; // extract through this cache, if set
+    enum scanFormat scanFormat; // only scan headers, if set
+    enum statsFormat stats; // report where the time went, if set
+    bool verbose, onlyPrintHeader, useMap, concurrent, verify, sparse, simg;
+} unpackOptions;
+
+/**
+ * What --stats reports for an image. Each slice is also counted in
+ * PHASE_SLICES, which took the wall time of them all, even if they were
+ * extracted concurrently.
+ */
+typedef struct {
+    phaseStats phases[PHASE_COUNT];
+    phaseStats slices[MAX_SLICES];
+    const char *sliceDests[MAX_SLICES], *sliceMethods[MAX_SLICES];
+    size_t slicesLen;
+} unpackStats;
+
+// The phases of every image in a batch, totalled as each one finishes
+phaseStats batchStats[PHASE_COUNT];
+
+/**
+ * Resources held while an image is being extracted, so they can be released
+ * even if throwError() unwinds part way through.
+ */
+typedef struct {
+    FILE *srcFile, *scriptFile, *destFiles[MAX_SLICES]; //see sliceMap
+    int destDirFd, cacheFd;
+    imageMap map;
+    ramdiskUnpacker ramdisk;
+    simgWriter simg[MAX_SLICES]; //see sliceMap
+    unpackStats stats;
+} unpackState;
+
+#define UNPACK_STATE_INIT { \
+    NULL, NULL, { NULL }, -1, -1, { NULL, 0 }, \
+    { .cpio = { .dirFd = -1, .entryDirFd = -1, .fileFd = -1 } }, \
+    { { .srcFd = -1 } }, { .slicesLen = 0 } \
+}
+
+void releaseUnpackState(unpackState *state){
+    for(size_t dest = 0; dest < MAX_SLICES; dest++)
+        if(state->destFiles[dest]) fclose(state->destFiles[dest]);
+    if(state->scriptFile) fclose(state->scriptFile);
+    if(state->srcFile) fclose(state->srcFile);
+    if(state->destDirFd >= 0) close(state->destDirFd);
+    if(state->cacheFd >= 0) close(state->cacheFd);
+    unmapImage(&state->map);
+    releaseRamdiskUnpacker(&state->ramdisk);
+    for(size_t dest = 0; dest < MAX_SLICES; dest++)
+        releaseSimgWriter(&state->simg[dest]);
+    *state = (unpackState)UNPACK_STATE_INIT;
+}
+
+/**
+ * A single slice to be extracted, possibly on its own thread.
+ */
+typedef struct {
+    FILE *srcFile, *destFile;
+    const imageMap *map; // NULL unless extracting from a mapping
+    ramdiskUnpacker *ramdisk; // Unpack into this rather than destFile
+    sha1Context *sha; // Add to this image ID hash, if set
+    sha1Context *cacheSha; // Add to this hash, to store the slice by
+    bool sparse; // Leave zero blocks in destFile as holes
+    simgWriter *simg; // Write destFile as a sparse image of this, if set
+    uint32_t offset, size, holes;
+    enum copyMethod method;
+    phaseStats stats;
+    bool failed;
+    pthread_t thread;
+} sliceJob;
+
+/**
+ * Adds a slice's size to the image ID hash, as a little-endian 32 bit word,
+ * the way mkbootimg's update_sha() does after each slice.
+ */
+void hashSliceSize(sha1Context *sha, uint32_t size){
+    uint8_t sizeBytes[4];
+
+    for(int i = 0; i < 4; i++) sizeBytes[i] = size >> (i * 8);
+    sha1Update(sha, sizeBytes, sizeof(sizeBytes));
+}
+
+/**
+ * Hands the next chunk of a slice to everything that needs to see its bytes:
+ * the image ID hash, and either the ramdisk unpacker or the dest file.
+ */
+void consumeSliceChunk(
+    sliceJob *job, const uint8_t *data, size_t size, size_t sliceOffset
+){
+    if(job->sha) sha1Update(job->sha, data, size);
+    if(job->cacheSha) sha1Update(job->cacheSha, data, size);
+    if(job->ramdisk) feedRamdisk(job->ramdisk, data, size);
+    else if(job->simg) feedSimg(job->simg, data, size, sliceOffset);
+    else if(job->destFile && job->sparse) job->holes += writeSparseAt(
+        fileno(job->destFile), data, size, sliceOffset
+    );
+    else if(job->destFile)
+        writeAt(fileno(job->destFile), data, size, sliceOffset);
+}
+
+/**
+ * Returns true if a slice's bytes have to pass through this process, rather
+ * than being copied by the kernel.
+ */
+bool needsSliceBytes(const sliceJob *job){
+    return job->ramdisk || job->sha || job->cacheSha || job->sparse
+        || job->simg || !job->destFile;
+}
+
+/**
+ * Reads a slice one chunk at a time, from the mapping if there is one, from
+ * the current position of the stream if stream is set, or else by pread(),
+ * handing each chunk to consumeSliceChunk().
+ */
+void readSlice(sliceJob *job, bool stream){
+    int srcFd = fileno(job->srcFile);
+    uint8_t *buffer = job->map ? NULL : getCopyBuffer();
+
+    if(job->map && job->offset + job->size > job->map->size) throwError(
+        "Unexpected end of input. Current offset: %luB", job->map->size
+    );
+
+    for(size_t done = 0; done < job->size;){
+        size_t quota = job->size - done < COPY_BUFFER_SIZE
+            ? job->size - done : COPY_BUFFER_SIZE;
+        const uint8_t *chunk = buffer;
+        ssize_t ret = quota;
+
+        if(job->map) chunk = job->map->data + job->offset + done;
+        else if(stream) readStream(srcFd, buffer, quota, job->offset + done);
+        else{
+            ret = pread(srcFd, buffer, quota, job->offset + done);
+            countSyscall(ret > 0 ? ret : 0);
+        }
+
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret < 0) throwError(
+            "Failed to read file. Current offset: %luB. %s",
+            job->offset + done, strerror(errno)
+        );
+        if(ret == 0) throwError(
+            "Unexpected end of input. Current offset: %luB",
+            job->offset + done
+        );
+        consumeSliceChunk(job, chunk, ret, done);
+        done += ret;
+    }
+
+    if(job->ramdisk) finishRamdisk(job->ramdisk);
+    if(job->sha) hashSliceSize(job->sha, job->size);
+    job->method = COPY_BUFFERED;
+
+    if(job->simg){
+        finishSimg(job->simg, fileno(job->destFile));
+        job->holes = job->simg->fills;
+        job->method = COPY_SIMG;
+    }
+
+    // Trailing holes weren't written, so the file may still be too short
+    else if(job->destFile && job->sparse){
+        if(ftruncate(fileno(job->destFile), job->size)) throwError(
+            "Failed to extend sparse slice to %uB. %s",
+            job->size, strerror(errno)
+        );
+        countSyscall(0);
+        job->method = COPY_SPARSE;
+    }
+}
+
+void extractSlice(sliceJob *job){
+    double start = beginPhase(&job->stats);
+
+    if(needsSliceBytes(job)) readSlice(job, false);
+    else if(job->map) writeMappedSlice(
+        job->map, job->destFile, job->offset, job->size
+    );
+    else job->method = writeSlice(
+        job->srcFile, job->destFile, job->offset, job->size
+    );
+
+    endPhase(&job->stats, start);
+}
+
+/**
+ * Extracts job, catching any error in it rather than unwinding past the
+ * caller, so that it can be rethrown once every thread has been joined.
+ * Returns false, with job->failed set, if it failed.
+ */
+bool catchSlice(sliceJob *job){
+    jmp_buf trap, *outerTrap = errorTrap;
+
+    errorTrap = &trap;
+    if(setjmp(trap) == 0) extractSlice(job);
+    else{
+        job->failed = true;
+        threadStats = NULL;
+    }
+    errorTrap = outerTrap;
+
+    return !job->failed;
+}
+
+void *sliceWorker(void *arg){
+    catchSlice(arg);
+    return NULL;
+}
+
+/**
+ * Extracts every slice in jobs, each on its own thread if concurrent is set.
+ */
+void extractSlices(sliceJob *jobs, size_t jobsLen, bool concurrent){
+    size_t started = 0;
+
+    if(concurrent) for(; started < jobsLen; started++){
+        int err = pthread_create(
+            &jobs[started].thread, NULL, sliceWorker, &jobs[started]
+        );
+        if(err){
+            throwWarning("Failed to start thread. %s", strerror(err));
+            break;
+        }
+    }
+
+    // Whatever couldn't be handed to a thread is extracted on this one, and
+    // the threads are still joined if that fails
+    if(!started){
+        for(size_t i = 0; i < jobsLen; i++) extractSlice(&jobs[i]);
+    }else for(size_t i = started; i < jobsLen; i++){
+        if(!catchSlice(&jobs[i])) break;
+    }
+
+    for(size_t i = 0; i < started; i++) pthread_join(jobs[i].thread, NULL);
+    for(size_t i = 0; i < jobsLen; i++) if(jobs[i].failed)
+        throwError("Failed to extract slice at offset %uB", jobs[i].offset);
+}
+
+/**
+ * Extracts every slice in jobs in a single pass over the stream srcFd,
+ * skipping the padding between them. jobs must be in order of offset, and
+ * streamOffset is the number of bytes of srcFd that have already been read.
+ */
+void streamSlices(sliceJob *jobs, size_t jobsLen, size_t streamOffset){
+    for(size_t i = 0; i < jobsLen; i++){
+        int srcFd = fileno(jobs[i].srcFile);
+        double start = beginPhase(&jobs[i].stats);
+
+        if(jobs[i].offset < streamOffset) throwError(
+            "Slice at offset %uB overlaps the previous one", jobs[i].offset
+        );
+        skipStream(srcFd, jobs[i].offset - streamOffset, streamOffset);
+        if(needsSliceBytes(&jobs[i])) readSlice(&jobs[i], true);
+        else jobs[i].method = streamSlice(
+            srcFd, jobs[i].destFile, jobs[i].size, jobs[i].offset
+        );
+        streamOffset = jobs[i].offset + jobs[i].size;
+
+        endPhase(&jobs[i].stats, start);
+    }
+}
+
+/**
+ * Checks that the image ID in header matches the hash of the slices that was
+ * accumulated in sha while they were extracted.
+ */
+void verifyImageId(
+    const bootHeader *header, sha1Context *sha, FILE *out, bool verbose
+){
+    uint8_t hashed[BOOT_ID_SIZE];
+    char expected[IMAGE_ID_SIZE], actual[IMAGE_ID_SIZE];
+
+    // mkbootimg pads the digest out to the size of the id with zeros
+    memset(hashed, 0, sizeof(hashed));
+    sha1Final(sha, hashed);
+
+    getImageId(expected, getHeaderId(header), false);
+    getImageId(actual, hashed, false);
+    if(memcmp(hashed, getHeaderId(header), sizeof(hashed)) != 0) throwError(
+        "Image ID doesn't match the image's contents. "
+        "Expected %s, but got %s", expected, actual
+    );
+    if(verbose) fprintf(
+        out, "Verified image ID %s, hashed using %s\n",
+        actual, sha1Implementation()
+    );
+}
+
+/**
+ * Fills in record from header and slices, with none of the slices stored.
+ */
+void fillCacheRecord(
+    cacheRecord *record, const bootHeader *header, const sliceMap *slices
+){
+    // header may already be in record
+    memmove(record->header, header->raw, header->layout->size);
+    memcpy(record->magic, CACHE_RECORD_MAGIC, sizeof(record->magic));
+    record->headerSize = header->layout->size;
+    record->slicesLen = slices->len;
+    for(size_t i = 0; i < slices->len; i++){
+        record->slices[i].offset = slices->slices[i].offset;
+        record->slices[i].size = slices->slices[i].size;
+        record->slices[i].stored = false;
+    }
+}
+
+/**
+ * Extracts every slice by linking it from the cache, as recorded in record.
+ * Returns false if any of them aren't in the cache, in which case they need
+ * to be extracted from the image after all.
+ */
+bool linkCachedSlices(
+    const cacheRecord *record, const sliceMap *slices,
+    const unpackState *state, FILE *out, bool verbose
+){
+    char object[CACHE_OBJECT_SIZE];
+
+    if(record->slicesLen != slices->len) return false;
+    for(size_t i = 0; i < slices->len; i++){
+        const char *dest = slices->slices[i].layout->dest, *method;
+
+        if(slices->slices[i].size == 0) continue;
+        if(!record->slices[i].stored) return false;
+
+        getCacheObject(object, record->slices[i].hash);
+        method = linkCacheObject(
+            state->cacheFd, object, state->destDirFd, dest
+        );
+        if(!method) return false;
+        if(verbose) fprintf(
+            out, "Linked %uB to \"%s\" from the cache using %s\n",
+            slices->slices[i].size, dest, method
+        );
+    }
+    return true;
+}
+
+/**
+ * Extracts the slices of src into destDir and writes its remake script, or
+ * just prints its header if opts->onlyPrintHeader is set. Progress and header
+ * information go to out.
+ */
+void unpackImage(
+    const char *src, const char *destDir,
+    const unpackOptions *opts, FILE *out, unpackState *state
+){
+    uint8_t headerBuf[MAX_HEADER_SIZE];
+    bootHeader header;
+    sliceMap slices;
+    bool verbose = opts->verbose;
+    sliceJob jobs[MAX_SLICES];
+    const char *jobDests[MAX_SLICES];
+    size_t jobsLen = 0, headerSize = 0;
+    size_t jobSlices[MAX_SLICES];
+    double start;
+    bool stream, extract = !opts->onlyPrintHeader;
+    sha1Context sha, cacheShas[MAX_SLICES];
+    cacheRecord record;
+    char cacheKey[CACHE_KEY_SIZE], object[CACHE_OBJECT_SIZE];
+    bool hasCacheKey = false, cached = false, linked = false;
+    phaseStats *phases = state->stats.phases;
+    double phaseStart;
+
+    // A src of "-" is stdin, which along with any other pipe, gets extracted
+    // in a single pass
+    phaseStart = beginPhase(&phases[PHASE_OPEN]);
+    state->srcFile = strcmp(src, "-") ? openFile(src, "r") : stdin;
+    stream = isStream(state->srcFile);
+    if(opts->cacheDir) state->cacheFd = openCache(opts->cacheDir);
+    if(opts->useMap) mapImage(&state->map, state->srcFile);
+    endPhase(&phases[PHASE_OPEN], phaseStart);
+
+    // If src has been extracted through the cache before, then its header is
+    // in the index
+    phaseStart = beginPhase(&phases[PHASE_HEADER]);
+    if(opts->cacheDir){
+        hasCacheKey = getCacheKey(cacheKey, state->srcFile);
+        cached = hasCacheKey && readCacheRecord(
+            &record, &header, state->cacheFd, cacheKey
+        );
+    }
+
+    // Read in header information
+    if(verbose) fprintf(
+        out, "Reading header%s...\n", cached ? " from the cache" : ""
+    );
+    if(!cached){
+        if(opts->useMap) mapHeader(&header, &state->map);
+        else if(stream) headerSize = readStreamHeader(
+            &header, headerBuf, fileno(state->srcFile)
+        );
+        else readHeader(&header, headerBuf, state->srcFile);
+    }
+    getSliceMap(&slices, &header);
+    endPhase(&phases[PHASE_HEADER], phaseStart);
+    if(verbose) fprintf(out, "---\n");
+    if(verbose || opts->onlyPrintHeader) writeHeaderInfo(out, &header);
+    if(verbose) fprintf(out, "---\n\n");
+    if(hasCacheKey && !cached) fillCacheRecord(&record, &header, &slices);
+    if(!extract && !opts->verify){
+        // Even just the header is worth indexing, for the next -i
+        if(hasCacheKey && !cached) writeCacheRecord(
+            &record, opts->cacheDir, state->cacheFd, cacheKey
+        );
+        return;
+    }
+
+    if(opts->verify && !hasHeaderField(&header, FIELD_ID)) throwError(
+        "%s header version %u has no image ID to verify",
+        header.layout->name, header.layout->version
+    );
+    phaseStart = beginPhase(&phases[PHASE_OPEN]);
+    if(extract) state->destDirFd = openDir(destDir);
+    if(opts->verify) sha1Init(&sha);
+
+    // Extract slices based on slices, and dump them to to their respective
+    // dests. Every dest is opened first, so that slices can then be
+    // extracted in any order. The remake script is written last, as it
+    // depends on what the ramdisk turns out to be compressed with.
+    if(extract){
+        const char *destName = opts->dests[DEST_MKSCRIPT];
+        if(verbose) fprintf(out, "Writing \"%s\"...\n", destName);
+        state->scriptFile = openFileAt(state->destDirFd, destName, "w");
+    }
+    endPhase(&phases[PHASE_OPEN], phaseStart);
+
+    // Slices that are all in the cache don't need to be read at all, unless
+    // they're being verified or turned into something else
+    if(cached && extract && !opts->verify && !opts->ramdiskDir
+        && !opts->sparse && !opts->simg
+    ){
+        phaseStart = beginPhase(&phases[PHASE_SLICES]);
+        linked = linkCachedSlices(&record, &slices, state, out, verbose);
+        endPhase(&phases[PHASE_SLICES], phaseStart);
+    }
+    if(linked){
+        phaseStart = beginPhase(&phases[PHASE_SCRIPT]);
+        writeMakeScript(
+            state->scriptFile, &header, &slices, opts->mkbootimgCmd,
+            opts->dests[DEST_NEWBOOT], NULL, NULL, false
+        );
+        endPhase(&phases[PHASE_SCRIPT], phaseStart);
+        return;
+    }
+
+    phaseStart = beginPhase(&phases[PHASE_OPEN]);
+
+    for(size_t i = 0; i < slices.len; i++){
+        FILE *destFile = NULL;
+        const char *destName = slices.slices[i].layout->dest;
+        bool isRamdisk = slices.slices[i].layout->field == FIELD_RAMDISK_SIZE;
+
+        // The image ID hashes the size of every slice, even empty ones
+        if(slices.slices[i].size == 0 && !opts->verify) continue;
+        if(!extract || slices.slices[i].size == 0){
+            // Only hashing, so there's nowhere to write to
+        }else if(isRamdisk && opts->ramdiskDir){
+            destName = opts->ramdiskDir;
+            initRamdiskUnpacker(
+                &state->ramdisk, openDirAt(state->destDirFd, destName)
+            );
+        }else{
+            // Replace rather than truncate dest, as it could be a hard link
+            // into a cache written by an older version
+            if(unlinkat(state->destDirFd, destName, 0) && errno != ENOENT)
+                throwError(
+                    "Failed to replace \"%s\". %s", destName, strerror(errno)
+                );
+            countSyscall(0);
+            destFile = openFileAt(state->destDirFd, destName, "w");
+            state->destFiles[i] = destFile;
+            if(opts->simg) initSimgWriter(
+                &state->simg[i], slices.slices[i].size,
+                opts->useMap ? &state->map : NULL,
+                stream ? -1 : fileno(state->srcFile), slices.slices[i].offset
+            );
+        }
+        if(verbose && extract && slices.slices[i].size)
+            fprintf(out, "Writing \"%s\"...\n", destName);
+
+        jobs[jobsLen++] = (sliceJob){
+            .srcFile = state->srcFile, .destFile = destFile,
+            .map = opts->useMap ? &state->map : NULL,
+            .ramdisk = destFile || !extract || !slices.slices[i].size
+                ? NULL : &state->ramdisk,
+            .sha = opts->verify ? &sha : NULL,
+            .sparse = opts->sparse && destFile,
+            .simg = state->simg[i].file ? &state->simg[i] : NULL,
+            .offset = slices.slices[i].offset, .size = slices.slices[i].size
+        };
+        jobDests[jobsLen - 1] = slices.slices[i].layout->dest;
+        jobSlices[jobsLen - 1] = i;
+
+        // Only slices that are extracted as-is can be stored in the cache
+        if(opts->cacheDir && destFile && !opts->sparse && !opts->simg){
+            sha1Init(&cacheShas[i]);
+            jobs[jobsLen - 1].cacheSha = &cacheShas[i];
+        }
+    }
+    endPhase(&phases[PHASE_OPEN], phaseStart);
+
+    start = getMonotonicTime();
+    // The image ID hashes the slices in order, so they can only be extracted
+    // concurrently if they're not being verified
+    if(stream) streamSlices(jobs, jobsLen, headerSize);
+    else extractSlices(jobs, jobsLen, opts->concurrent && !opts->verify);
+    phases[PHASE_SLICES].nanoseconds += (getMonotonicTime() - start) * 1e9;
+    for(size_t i = 0; i < jobsLen; i++){
+        unpackStats *stats = &state->stats;
+
+        phases[PHASE_SLICES].bytes += jobs[i].stats.bytes;
+        phases[PHASE_SLICES].syscalls += jobs[i].stats.syscalls;
+        if(jobs[i].size == 0) continue;
+        stats->slices[stats->slicesLen] = jobs[i].stats;
+        stats->sliceDests[stats->slicesLen] = jobDests[i];
+        stats->sliceMethods[stats->slicesLen++] = jobs[i].ramdisk ? "unpack"
+            : !jobs[i].destFile ? "hash"
+            : jobs[i].map && !jobs[i].simg && !jobs[i].sparse ? "mapping"
+            : copyMethodNames[jobs[i].method];
+    }
+    if(verbose){
+        for(size_t i = 0; i < jobsLen; i++){
+            if(jobs[i].size == 0) continue;
+            if(jobs[i].ramdisk) fprintf(
+                out, "Unpacked %uB %s ramdisk to \"%s\" (%zu entries) "
+                "in %.3fms\n", jobs[i].size,
+                ramdiskFormatNames[jobs[i].ramdisk->format],
+                opts->ramdiskDir, jobs[i].ramdisk->cpio.entries,
+                jobs[i].stats.nanoseconds / 1e6
+            );
+            else if(!jobs[i].destFile) fprintf(
+                out, "Hashed %uB of \"%s\" in %.3fms\n",
+                jobs[i].size, jobDests[i], jobs[i].stats.nanoseconds / 1e6
+            );
+            else fprintf(
+                out, "Copied %uB to \"%s\" using %s%s in %.3fms\n",
+                jobs[i].size, jobDests[i],
+                jobs[i].map ? "mapping" : copyMethodNames[jobs[i].method],
+                jobs[i].map && jobs[i].simg ? " (simg)"
+                    : jobs[i].map && jobs[i].sparse ? " (sparse)" : "",
+                jobs[i].stats.nanoseconds / 1e6
+            );
+            if(jobs[i].sparse || jobs[i].simg) fprintf(
+                out, "Left %uB of \"%s\" as %s\n",
+                jobs[i].holes, jobDests[i],
+                jobs[i].simg ? "fill chunks" : "holes"
+            );
+        }
+        fprintf(
+            out, "Extracted %zu slices %sin %.3fms\n", jobsLen,
+            opts->concurrent && !opts->verify && !stream
+                ? "concurrently " : "",
+            (getMonotonicTime() - start) * 1000
+        );
+    }
+
+    if(opts->verify) verifyImageId(&header, &sha, out, verbose || !extract);
+
+    // Store what was just extracted, and index it so that next time, it can
+    // be linked from the cache instead
+    phaseStart = beginPhase(&phases[PHASE_SLICES]);
+    for(size_t i = 0; i < jobsLen; i++){
+        size_t slice = jobSlices[i];
+
+        if(!jobs[i].cacheSha) continue;
+        sha1Final(jobs[i].cacheSha, record.slices[slice].hash);
+        getCacheObject(object, record.slices[slice].hash);
+        record.slices[slice].stored = storeCacheObject(
+            state->cacheFd, object, state->destDirFd, jobDests[i]
+        );
+        if(!record.slices[slice].stored){
+            throwWarning(
+                "Failed to store \"%s\" in the cache. %s",
+                jobDests[i], strerror(errno)
+            );
+        }else if(verbose) fprintf(
+            out, "Stored \"%s\" in the cache as %s\n", jobDests[i], object
+        );
+    }
+    if(hasCacheKey && opts->cacheDir) writeCacheRecord(
+        &record, opts->cacheDir, state->cacheFd, cacheKey
+    );
+    endPhase(&phases[PHASE_SLICES], phaseStart);
+    if(!extract) return;
+
+    phaseStart = beginPhase(&phases[PHASE_SCRIPT]);
+    writeMakeScript(
+        state->scriptFile, &header, &slices,
+        opts->mkbootimgCmd, opts->dests[DEST_NEWBOOT], opts->ramdiskDir,
+        ramdiskCompressCmds[state->ramdisk.format], opts->simg
+    );
+    endPhase(&phases[PHASE_SCRIPT], phaseStart);
+}
+
+/**
+ * Writes the time and bytes of phase as a line of text, along with the lower
+ * bound on its syscalls, or as a JSON object without them.
+ */
+void writePhaseStats(
+    FILE *destFile, const char *name, const phaseStats *phase,
+    enum statsFormat format
+){
+    if(format == STATS_JSON) fprintf(
+        destFile, "\"%s\":{\"ms\":%.3f,\"bytes\":%llu}",
+        name, phase->nanoseconds / 1e6, (unsigned long long)phase->bytes
+    );
+    else fprintf(
+        destFile, "%s: %.3fms, %lluB, at least %llu syscalls\n",
+        name, phase->nanoseconds / 1e6,
+        (unsigned long long)phase->bytes,
+        (unsigned long long)phase->syscalls
+    );
+}
+
+/**
+ * Writes the stats of every phase in phases, and their total, to destFile.
+ * If stats is set, these are for the image src, and the slices are broken
+ * out too. Otherwise, they're the total of a batch of imagesLen images.
+ */
+void writeStats(
+    FILE *destFile, enum statsFormat format, const phaseStats *phases,
+    const unpackStats *stats, const char *src, size_t imagesLen
+){
+    bool json = format == STATS_JSON;
+    phaseStats total = { 0, 0, 0 };
+    char name[64];
+
+    if(json && stats){
+        fprintf(destFile, "{\"src\":");
+        writeJsonString(destFile, src, strlen(src));
+        fprintf(destFile, ",\"phases\":{");
+    }else if(json) fprintf(
+        destFile, "{\"images\":%zu,\"phases\":{", imagesLen
+    );
+    else if(stats) fprintf(destFile, "Stats for \"%s\":\n", src);
+    else fprintf(destFile, "Stats for %zu images:\n", imagesLen);
+
+    for(int i = 0; i < PHASE_COUNT; i++){
+        if(json && i) fputc(',', destFile);
+        else if(!json) fprintf(destFile, "  ");
+        writePhaseStats(destFile, statsPhaseNames[i], &phases[i], format);
+        total.nanoseconds += phases[i].nanoseconds;
+        total.bytes += phases[i].bytes;
+        total.syscalls += phases[i].syscalls;
+
+        // As text, the slices are listed under their phase
+        if(i != PHASE_SLICES || !stats || json) continue;
+        for(size_t j = 0; j < stats->slicesLen; j++){
+            snprintf(
+                name, sizeof(name), "%s (%s)",
+                stats->sliceDests[j], stats->sliceMethods[j]
+            );
+            fprintf(destFile, "    ");
+            writePhaseStats(destFile, name, &stats->slices[j], format);
+        }
+    }
+
+    if(json && stats){
+        fprintf(destFile, "},\"slices\":{");
+        for(size_t j = 0; j < stats->slicesLen; j++){
+            snprintf(
+                name, sizeof(name), "%s (%s)",
+                stats->sliceDests[j], stats->sliceMethods[j]
+            );
+            if(j) fputc(',', destFile);
+            writePhaseStats(destFile, name, &stats->slices[j], format);
+        }
+    }
+    if(json) fprintf(destFile, "},");
+    else fprintf(destFile, "  ");
+    writePhaseStats(destFile, "total", &total, format);
+    if(json) fprintf(destFile, "}\n");
+}
+
+/**
+ * Closes the files that src was extracted to, so that any errors in writing
+ * them out are caught, then adds its stats to batchStats, and writes them to
+ * out if opts->stats is set.
+ */
+void finishUnpack(
+    const char *src, const unpackOptions *opts, FILE *out,
+    unpackState *state
+){
+    phaseStats *phases = state->stats.phases;
+    double phaseStart = beginPhase(&phases[PHASE_CLOSE]);
+
+    for(size_t dest = 0; dest < MAX_SLICES; dest++){
+        if(!state->destFiles[dest]) continue;
+        if(fclose(state->destFiles[dest])) throwError(
+            "Failed to write extracted slice. %s", strerror(errno)
+        );
+        countSyscall(0);
+        state->destFiles[dest] = NULL;
+    }
+    if(state->scriptFile){
+        if(fclose(state->scriptFile)) throwError(
+            "Failed to write remake script. %s", strerror(errno)
+        );
+        countSyscall(0);
+        state->scriptFile = NULL;
+    }
+    endPhase(&phases[PHASE_CLOSE], phaseStart);
+
+    for(int i = 0; i < PHASE_COUNT; i++)
+        addPhaseStats(&batchStats[i], &phases[i]);
+    if(opts->stats) writeStats(out, opts->stats, phases, &state->stats, src, 1);
+}
+
+/**
+ * As unpackImage(), but returns false rather than exiting on error.
+ */
+bool tryUnpackImage(
+    const char *src, const char *destDir,
+    const unpackOptions *opts, FILE *out
+){
+    unpackState state = UNPACK_STATE_INIT;
+    jmp_buf trap;
+    bool ok = false;
+
+    errorTrap = &trap;
+    if(setjmp(trap) == 0){
+        unpackImage(src, destDir, opts, out, &state);
+        finishUnpack(src, opts, out, &state);
+        ok = true;
+    }else threadStats = NULL; // the phase that threw never ended
+    errorTrap = NULL;
+
+    releaseUnpackState(&state);
+    return ok;
+}
+
+/**
+ * A list of images shared by the threads of a batch. Each thread claims the
+ * next unclaimed image as soon as it finishes its last, so that a few large
+ * images don't leave the other threads idle.
+ */
+typedef struct {
+    char **srcs;
+    size_t srcsLen, srcsSize;
+    size_t next, failed;
+    const unpackOptions *opts;
+    bool readsStdin; // whether an image or the list is "-" already
+} batchQueue;
+
+/**
+ * Notes that queue reads stdin for what, which it can only do once.
+ */
+void claimBatchStdin(batchQueue *queue, const char *what){
+    if(queue->readsStdin) throwError(
+        "Can't read %s from stdin, as it's already being read", what
+    );
+    queue->readsStdin = true;
+}
+
+void pushBatchImage(batchQueue *queue, const char *src){
+    if(strcmp(src, "-") == 0) claimBatchStdin(queue, "an image");
+    if(queue->srcsLen == queue->srcsSize){
+        queue->srcsSize = queue->srcsSize ? queue->srcsSize * 2 : 64;
+        queue->srcs = realloc(
+            queue->srcs, queue->srcsSize * sizeof(*queue->srcs)
+        );
+        if(!queue->srcs) throwError(
+            "Failed to grow image list. %s", strerror(errno)
+        );
+    }
+    if(!(queue->srcs[queue->srcsLen++] = strdup(src))) throwError(
+        "Failed to copy image name. %s", strerror(errno)
+    );
+}
+
+/**
+ * Adds every line of listPath (or stdin if it's "-") to queue as an image.
+ */
+void readBatchList(batchQueue *queue, const char *listPath){
+    FILE *listFile = stdin;
+    char *line = NULL;
+    size_t lineSize = 0;
+    ssize_t lineLen;
+
+    if(strcmp(listPath, "-")) listFile = openFile(listPath, "r");
+    else claimBatchStdin(queue, "the image list");
+
+    while((lineLen = getline(&line, &lineSize, listFile)) >= 0){
+        if(lineLen && line[lineLen - 1] == '\n') line[--lineLen] = '\0';
+        if(lineLen) pushBatchImage(queue, line);
+    }
+
+    free(line);
+    if(listFile != stdin) fclose(listFile);
+}
+
+typedef struct {
+    char *dir;
+    const char *src;
+} batchDest;
+
+int compareBatchDests(const void *a, const void *b){
+    return strcmp(((const batchDest*)a)->dir, ((const batchDest*)b)->dir);
+}
+
+/**
+ * Fails if any two images in queue would be extracted into the same
+ * directory (eg. "fw1/boot.img" and "fw2/boot.img" with -d), before any of
+ * them are, rather than letting one overwrite the other.
+ */
+void checkBatchDestDirs(const batchQueue *queue){
+    batchDest *dests = malloc(queue->srcsLen * sizeof(*dests));
+    char destDir[PATH_MAX];
+    size_t destsLen = 0;
+
+    if(!dests) throwError(
+        "Failed to allocate image list. %s", strerror(errno)
+    );
+    for(size_t i = 0; i < queue->srcsLen; i++){
+        // Paths that are too long are reported when they're extracted
+        if(!getBatchDestDir(
+            destDir, PATH_MAX, queue->srcs[i], queue->opts->destDir
+        )) continue;
+        if(!(dests[destsLen].dir = strdup(destDir))) throwError(
+            "Failed to copy directory name. %s", strerror(errno)
+        );
+        dests[destsLen++].src = queue->srcs[i];
+    }
+
+    qsort(dests, destsLen, sizeof(*dests), compareBatchDests);
+    for(size_t i = 1; i < destsLen; i++){
+        if(strcmp(dests[i].dir, dests[i - 1].dir)) continue;
+        throwError(
+            "\"%s\" and \"%s\" would both be extracted to \"%s\"",
+            dests[i - 1].src, dests[i].src, dests[i].dir
+        );
+    }
+    for(size_t i = 0; i < destsLen; i++) free(dests[i].dir);
+    free(dests);
+}
+
+void *batchWorker(void *arg){
+    batchQueue *queue = arg;
+    char destDir[PATH_MAX];
+    size_t i;
+
+    while((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED))
+        < queue->srcsLen
+    ){
+        const char *src = queue->srcs[i];
+        char *log = NULL;
+        size_t logLen = 0;
+        FILE *out;
+        bool ok;
+
+        // Buffer each image's output, so that images don't interleave
+        if(!(out = open_memstream(&log, &logLen))) throwError(
+            "Failed to allocate output buffer. %s", strerror(errno)
+        );
+        if(queue->opts->verbose || queue->opts->onlyPrintHeader)
+            fprintf(out, "==> %s <==\n", src);
+
+        if(!getBatchDestDir(destDir, PATH_MAX, src, queue->opts->destDir)){
+            throwWarning("Path too long for \"%s\"", src);
+            ok = false;
+        }else ok = tryUnpackImage(src, destDir, queue->opts, out);
+
+        fclose(out);
+        if(!ok){
+            fprintf(stderr, "Failed to unpack \"%s\"\n", src);
+            __atomic_add_fetch(&queue->failed, 1, __ATOMIC_RELAXED);
+        }else if(logLen){
+            flockfile(stdout);
+            fwrite(log, logLen, 1, stdout);
+            funlockfile(stdout);
+        }
+        free(log);
+    }
+
+    return NULL;
+}
+
+/**
+ * Writes out and resets the scan records that have built up in records.
+ */
+void flushScanRecords(FILE **records, char **buffer, size_t *bufferLen){
+    fclose(*records);
+    if(*bufferLen){
+        flockfile(stdout);
+        fwrite(*buffer, *bufferLen, 1, stdout);
+        funlockfile(stdout);
+    }
+    free(*buffer);
+    *buffer = NULL;
+    *bufferLen = 0;
+    if(!(*records = open_memstream(buffer, bufferLen))) throwError(
+        "Failed to allocate output buffer. %s", strerror(errno)
+    );
+}
+
+/**
+ * As batchWorker(), but only scans the header of each image. Records are
+ * written out in batches, rather than one image at a time, as each one is
+ * so small.
+ */
+void *scanWorker(void *arg){
+    batchQueue *queue = arg;
+    char *buffer = NULL;
+    size_t bufferLen = 0, i;
+    FILE *records;
+
+    if(!(records = open_memstream(&buffer, &bufferLen))) throwError(
+        "Failed to allocate output buffer. %s", strerror(errno)
+    );
+
+    while((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED))
+        < queue->srcsLen
+    ){
+        if(!scanImage(queue->srcs[i], queue->opts->scanFormat, records))
+            __atomic_add_fetch(&queue->failed, 1, __ATOMIC_RELAXED);
+        if(ftell(records) >= SCAN_FLUSH_SIZE)
+            flushScanRecords(&records, &buffer, &bufferLen);
     }
-    changeDir(destDir);
 
-    // Read in header information
-    if(verbose) printf("Reading header...\n");
-    readHeader(&header, srcFile);
-    getSizeMap(sizeMap, &header);
-    getOffsetMap(offsetMap, &header);
-    if(verbose) printf("---\n");
-	if(verbose || onlyPrintHeader) writeHeaderInfo(stdout, &header);
-	if(verbose) printf("---\n\n");
-
-    // Extract slices based on offsetMap, and dump them to to their
-    // respective dests.
-    if(!onlyPrintHeader) for(size_t dest = 0; dest <= SLICE_SECOND; dest++){
-        if(sizeMap[dest] == 0) continue;
-        if(verbose) printf("Writing \"%s\"...\n", dests[dest]);
-        destFile = openFile(dests[dest], "w");
-
-        switch(dest){
-            case DEST_MKSCRIPT:
-                writeMakeScript(destFile, dests, mkbootimgCmd, &header);
+    fclose(records);
+    if(bufferLen){
+        flockfile(stdout);
+        fwrite(buffer, bufferLen, 1, stdout);
+        funlockfile(stdout);
+    }
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Extracts (or scans) every image in queue using jobs threads.
+ * Returns the number of images that failed.
+ */
+size_t runBatch(batchQueue *queue, long jobs){
+    void *(*worker)(void*) = queue->opts->scanFormat
+        ? scanWorker : batchWorker;
+    pthread_t *threads;
+    long started;
+
+    if(!queue->opts->scanFormat) checkBatchDestDirs(queue);
+    if(jobs < 1) jobs = 1;
+    if((size_t)jobs > queue->srcsLen) jobs = queue->srcsLen;
+    if(!(threads = calloc(jobs, sizeof(*threads)))) throwError(
+        "Failed to allocate threads. %s", strerror(errno)
+    );
+
+    for(started = 0; started < jobs; started++){
+        int err = pthread_create(
+            &threads[started], NULL, worker, queue
+        );
+        if(err){
+            throwWarning("Failed to start thread. %s", strerror(err));
+            break;
+        }
+    }
+
+    // Make do with this thread if no others could be started
+    if(started == 0) worker(queue);
+    for(long i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    if(queue->opts->stats && !queue->opts->scanFormat) writeStats(
+        stdout, queue->opts->stats, batchStats, NULL, NULL,
+        queue->srcsLen - queue->failed
+    );
+    free(threads);
+    return queue->failed;
+}
+
+/**
+ * Delta format written by --diff and read by --apply. The header is followed
+ * by ops that each rebuild the next stretch of the target image, encoded as a
+ * varint of their size shifted left by one, with the low bit set for copies.
+ * Copies are followed by a zigzag varint of where they start in the source,
+ * relative to where the previous copy ended, while the data of literals
+ * follows them inline.
+ */
+#define DELTA_MAGIC "UMKBDLT1"
+typedef struct __attribute__((packed)) {
+    char magic[8];
+    uint64_t srcSize, targetSize;
+    uint8_t srcHash[SHA1_DIGEST_SIZE], targetHash[SHA1_DIGEST_SIZE];
+} deltaHeader;
+
+// The source is indexed in blocks of this size. It's the smallest page size,
+// so every slice of the source starts on a block.
+#define DELTA_BLOCK_SIZE 2048
+
+// Blocks hashed at a time by each indexing thread
+#define DELTA_HASH_CHUNK 1024
+
+// Candidates checked per lookup, to bound the cost of weak hash collisions
+#define DELTA_MAX_CHAIN 64
+
+#define DELTA_MAX_VARINT 10
+
+/**
+ * The rsync weak checksum, which can be rolled along a byte at a time.
+ */
+typedef struct {
+    uint32_t a, b;
+} rollingHash;
+
+void initRollingHash(rollingHash *hash, const uint8_t *data){
+    hash->a = hash->b = 0;
+    for(size_t i = 0; i < DELTA_BLOCK_SIZE; i++){
+        hash->a += data[i];
+        hash->b += (DELTA_BLOCK_SIZE - i) * data[i];
+    }
+}
+
+void rollHash(rollingHash *hash, uint8_t out, uint8_t in){
+    hash->a += in - out;
+    hash->b += hash->a - DELTA_BLOCK_SIZE * out;
+}
+
+uint32_t getRollingHash(const rollingHash *hash){
+    return (hash->a & 0xffff) | hash->b << 16;
+}
+
+/**
+ * Finds blocks of the source by their rolling hash.
+ */
+typedef struct {
+    const imageMap *src;
+    uint32_t *hashes; // of every block of src
+    uint32_t *buckets; // index + 1 of the first block with each hash
+    uint32_t *next; // index + 1 of the next block in the same bucket
+    size_t blocksLen, bucketMask;
+    size_t nextBlock; // next block to be hashed, shared between threads
+} deltaIndex;
+
+void *deltaIndexWorker(void *arg){
+    deltaIndex *index = arg;
+    rollingHash hash;
+    size_t first, last;
+
+    while((first = __atomic_fetch_add(
+        &index->nextBlock, DELTA_HASH_CHUNK, __ATOMIC_RELAXED
+    )) < index->blocksLen){
+        last = first + DELTA_HASH_CHUNK;
+        if(last > index->blocksLen) last = index->blocksLen;
+        for(size_t i = first; i < last; i++){
+            initRollingHash(
+                &hash, index->src->data + i * DELTA_BLOCK_SIZE
+            );
+            index->hashes[i] = getRollingHash(&hash);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Hashes every whole block of src using up to jobs threads, then indexes them.
+ * Returns the number of threads that were used.
+ */
+long buildDeltaIndex(deltaIndex *index, const imageMap *src, long jobs){
+    size_t bucketsLen = 1;
+    pthread_t *threads;
+    long started;
+
+    index->src = src;
+    index->blocksLen = src->size / DELTA_BLOCK_SIZE;
+    index->nextBlock = 0;
+    if(index->blocksLen >= UINT32_MAX) throwError(
+        "Source image is too large to be indexed"
+    );
+    while(bucketsLen < index->blocksLen * 2) bucketsLen *= 2;
+    index->bucketMask = bucketsLen - 1;
+    index->hashes = malloc(index->blocksLen * sizeof(*index->hashes) + 1);
+    index->next = malloc(index->blocksLen * sizeof(*index->next) + 1);
+    index->buckets = calloc(bucketsLen, sizeof(*index->buckets));
+    if(!index->hashes || !index->next || !index->buckets) throwError(
+        "Failed to allocate source index. %s", strerror(errno)
+    );
+
+    // Hash the blocks concurrently, as it's the bulk of the work
+    if(jobs < 1) jobs = 1;
+    if((size_t)jobs * DELTA_HASH_CHUNK > index->blocksLen)
+        jobs = (index->blocksLen + DELTA_HASH_CHUNK - 1) / DELTA_HASH_CHUNK;
+    if(!(threads = calloc(jobs + 1, sizeof(*threads)))) throwError(
+        "Failed to allocate threads. %s", strerror(errno)
+    );
+    for(started = 0; started < jobs; started++){
+        int err = pthread_create(
+            &threads[started], NULL, deltaIndexWorker, index
+        );
+        if(err){
+            throwWarning("Failed to start thread. %s", strerror(err));
+            break;
+        }
+    }
+    if(started == 0) deltaIndexWorker(index);
+    for(long i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+
+    // Insert back to front, so that the earliest block is found first
+    for(size_t i = index->blocksLen; i-- > 0;){
+        uint32_t *bucket =
+            &index->buckets[index->hashes[i] & index->bucketMask];
+        index->next[i] = *bucket;
+        *bucket = i + 1;
+    }
+
+    return started ? started : 1;
+}
+
+void releaseDeltaIndex(deltaIndex *index){
+    free(index->hashes);
+    free(index->next);
+    free(index->buckets);
+}
+
+/**
+ * Returns the offset of a block in the source that matches the block at data,
+ * or -1 if there isn't one.
+ */
+int64_t findDeltaBlock(
+    const deltaIndex *index, uint32_t hash, const uint8_t *data
+){
+    uint32_t i = index->buckets[hash & index->bucketMask];
+
+    for(int chain = 0; i && chain < DELTA_MAX_CHAIN; chain++){
+        const uint8_t *block = index->src->data
+            + (size_t)(i - 1) * DELTA_BLOCK_SIZE;
+        if(index->hashes[i - 1] == hash
+            && memcmp(block, data, DELTA_BLOCK_SIZE) == 0
+        ) return (int64_t)(i - 1) * DELTA_BLOCK_SIZE;
+        i = index->next[i - 1];
+    }
+
+    return -1;
+}
+
+/**
+ * Returns how many bytes at the start of a and b are the same, up to max.
+ */
+size_t getMatchLength(const uint8_t *a, const uint8_t *b, size_t max){
+    size_t len = 0;
+
+    while(len + 64 <= max && memcmp(a + len, b + len, 64) == 0) len += 64;
+    while(len < max && a[len] == b[len]) len++;
+    return len;
+}
+
+/**
+ * One stretch of the target image, either copied from the source or given
+ * literally.
+ */
+typedef struct {
+    uint64_t targetOffset, srcOffset, size;
+    bool copy;
+} deltaOp;
+
+typedef struct {
+    deltaOp *ops;
+    size_t len, size;
+} deltaOps;
+
+void pushDeltaOp(
+    deltaOps *ops, bool copy, uint64_t srcOffset, uint64_t targetOffset,
+    uint64_t size
+){
+    if(ops->len == ops->size){
+        ops->size = ops->size ? ops->size * 2 : 64;
+        ops->ops = realloc(ops->ops, ops->size * sizeof(*ops->ops));
+        if(!ops->ops) throwError(
+            "Failed to grow delta. %s", strerror(errno)
+        );
+    }
+    ops->ops[ops->len++] = (deltaOp){
+        .targetOffset = targetOffset, .srcOffset = srcOffset,
+        .size = size, .copy = copy
+    };
+}
+
+/**
+ * Finds the ops that rebuild target from the source in index, rolling a hash
+ * along target to find the blocks it shares with the source wherever they've
+ * moved to, then growing each match out to the bytes either side.
+ */
+void diffImageData(
+    deltaOps *ops, const deltaIndex *index, const imageMap *target
+){
+    const uint8_t *src = index->src->data, *data = target->data;
+    size_t srcSize = index->src->size, size = target->size;
+    size_t pos = 0, literal = 0; // literal is where unmatched data starts
+    rollingHash hash;
+
+    if(size >= DELTA_BLOCK_SIZE) initRollingHash(&hash, data);
+    while(pos + DELTA_BLOCK_SIZE <= size){
+        int64_t match = findDeltaBlock(
+            index, getRollingHash(&hash), data + pos
+        );
+        size_t back = 0, len;
+
+        if(match < 0){
+            if(pos + DELTA_BLOCK_SIZE < size) rollHash(
+                &hash, data[pos], data[pos + DELTA_BLOCK_SIZE]
+            );
+            pos++;
+            continue;
+        }
+
+        while(pos - back > literal && (size_t)match - back > 0
+            && src[match - back - 1] == data[pos - back - 1]
+        ) back++;
+        len = srcSize - match < size - pos ? srcSize - match : size - pos;
+        len = DELTA_BLOCK_SIZE + getMatchLength(
+            src + match + DELTA_BLOCK_SIZE, data + pos + DELTA_BLOCK_SIZE,
+            len - DELTA_BLOCK_SIZE
+        );
+
+        if(pos - back > literal)
+            pushDeltaOp(ops, false, 0, literal, pos - back - literal);
+        pushDeltaOp(ops, true, match - back, pos - back, len + back);
+        pos += len;
+        literal = pos;
+        if(pos + DELTA_BLOCK_SIZE <= size) initRollingHash(&hash, data + pos);
+    }
+    if(literal < size) pushDeltaOp(ops, false, 0, literal, size - literal);
+}
+
+/**
+ * Returns how many bytes between offset and offset + size of the target are
+ * given literally by ops, rather than copied from the source.
+ */
+uint64_t getLiteralSize(const deltaOps *ops, uint64_t offset, uint64_t size){
+    uint64_t literal = 0;
+
+    for(size_t i = 0; i < ops->len; i++){
+        const deltaOp *op = &ops->ops[i];
+        uint64_t start = op->targetOffset > offset ? op->targetOffset : offset;
+        uint64_t end = op->targetOffset + op->size;
+
+        if(end > offset + size) end = offset + size;
+
+        if(!op->copy && start < end) literal += end - start;
+    }
+    return literal;
+}
+
+size_t putVarint(uint8_t buffer[DELTA_MAX_VARINT], uint64_t value){
+    size_t len = 0;
+
+    while(value >= 0x80){
+        buffer[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buffer[len++] = value;
+    return len;
+}
+
+bool getVarint(FILE *srcFile, uint64_t *value){
+    int byte;
+
+    *value = 0;
+    for(int shift = 0; shift < 64; shift += 7){
+        if((byte = getc(srcFile)) == EOF) return false;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+void hashImage(uint8_t hash[SHA1_DIGEST_SIZE], const imageMap *map){
+    sha1Context sha;
+
+    sha1Init(&sha);
+    sha1Update(&sha, map->data, map->size);
+    sha1Final(&sha, hash);
+}
+
+/**
+ * Writes ops as a delta from src to target into deltaFile.
+ * Returns the size of the delta.
+ */
+uint64_t writeDelta(
+    FILE *deltaFile, const deltaOps *ops, const imageMap *src,
+    const imageMap *target
+){
+    deltaHeader header = { .srcSize = src->size, .targetSize = target->size };
+    uint8_t varint[DELTA_MAX_VARINT];
+    uint64_t srcOffset = 0, deltaSize = sizeof(header);
+    size_t len;
+
+    memcpy(header.magic, DELTA_MAGIC, sizeof(header.magic));
+    hashImage(header.srcHash, src);
+    hashImage(header.targetHash, target);
+    fwrite(&header, sizeof(header), 1, deltaFile);
+
+    for(size_t i = 0; i < ops->len; i++){
+        const deltaOp *op = &ops->ops[i];
+
+        len = putVarint(varint, op->size << 1 | op->copy);
+        fwrite(varint, len, 1, deltaFile);
+        deltaSize += len;
+        if(op->copy){
+            int64_t skip = op->srcOffset - srcOffset;
+            len = putVarint(varint, (uint64_t)skip << 1 ^ (skip >> 63));
+            fwrite(varint, len, 1, deltaFile);
+            deltaSize += len;
+            srcOffset = op->srcOffset + op->size;
+        }else{
+            fwrite(target->data + op->targetOffset, op->size, 1, deltaFile);
+            deltaSize += op->size;
+        }
+    }
+
+    if(fflush(deltaFile) || ferror(deltaFile)) throwError(
+        "Failed to write delta. %s", strerror(errno)
+    );
+    return deltaSize;
+}
+
+/**
+ * Returns the header lines that writeHeaderInfo() would write for field of
+ * header, or an empty string if it doesn't have it. Must be freed.
+ */
+char *formatHeaderField(const bootHeader *header, enum headerField field){
+    char *text = NULL;
+    size_t textLen = 0;
+    FILE *textFile;
+
+    if(!(textFile = open_memstream(&text, &textLen))) throwError(
+        "Failed to allocate output buffer. %s", strerror(errno)
+    );
+    writeHeaderField(textFile, header, field, "");
+    fclose(textFile);
+    return text;
+}
+
+/**
+ * Writes the lines of text, each starting with prefix.
+ */
+void writePrefixed(FILE *destFile, const char *prefix, const char *text){
+    while(*text){
+        size_t len = strcspn(text, "\n");
+        fprintf(destFile, "%s%.*s\n", prefix, (int)len, text);
+        text += len + (text[len] == '\n');
+    }
+}
+
+/**
+ * Compares the headers of srcPath and targetPath field by field, and their
+ * slices block by block, writing what's changed to out. If deltaPath is set,
+ * also writes a delta to it that --apply can rebuild targetPath with from
+ * srcPath.
+ */
+void diffImages(
+    const char *srcPath, const char *targetPath, const char *deltaPath,
+    long jobs, bool verbose, FILE *out
+){
+    FILE *srcFile = openFile(srcPath, "r");
+    FILE *targetFile = openFile(targetPath, "r");
+    FILE *deltaFile = deltaPath ? openFile(deltaPath, "w") : NULL;
+    imageMap src = { NULL, 0 }, target = { NULL, 0 };
+    bootHeader srcHeader, targetHeader;
+    sliceMap srcSlices, targetSlices;
+    deltaIndex index;
+    deltaOps ops = { NULL, 0, 0 };
+    uint64_t literal;
+    double start;
+    long threads;
+
+    mapImage(&src, srcFile);
+    mapImage(&target, targetFile);
+    mapHeader(&srcHeader, &src);
+    mapHeader(&targetHeader, &target);
+    getSliceMap(&srcSlices, &srcHeader);
+    getSliceMap(&targetSlices, &targetHeader);
+
+    // Header, field by field, as writeHeaderInfo() would show it
+    fprintf(out, "--- %s\n+++ %s\n", srcPath, targetPath);
+    if(strcmp(srcHeader.layout->name, targetHeader.layout->name)) fprintf(
+        out, "- Image type: %s\n+ Image type: %s\n",
+        srcHeader.layout->name, targetHeader.layout->name
+    );
+    for(int field = 0; field < FIELD_COUNT; field++){
+        char *srcText = formatHeaderField(&srcHeader, field);
+        char *targetText = formatHeaderField(&targetHeader, field);
+
+        if(strcmp(srcText, targetText)){
+            writePrefixed(out, "- ", srcText);
+            writePrefixed(out, "+ ", targetText);
+        }else if(verbose) writePrefixed(out, "  ", srcText);
+        free(srcText);
+        free(targetText);
+    }
+
+    // Slices, block by block
+    start = getMonotonicTime();
+    threads = buildDeltaIndex(&index, &src, jobs);
+    if(verbose) fprintf(
+        out, "Indexed %zu blocks of \"%s\" with %ld threads in %.3fms\n",
+        index.blocksLen, srcPath, threads,
+        (getMonotonicTime() - start) * 1000
+    );
+    start = getMonotonicTime();
+    diffImageData(&ops, &index, &target);
+    if(verbose) fprintf(
+        out, "Matched %zu ops against \"%s\" in %.3fms\n",
+        ops.len, targetPath, (getMonotonicTime() - start) * 1000
+    );
+
+    for(size_t i = 0; i < targetSlices.len; i++){
+        const slice *targetSlice = &targetSlices.slices[i];
+        const slice *srcSlice = NULL;
+
+        for(size_t j = 0; j < srcSlices.len; j++)
+            if(srcSlices.slices[j].layout->field == targetSlice->layout->field)
+                srcSlice = &srcSlices.slices[j];
+
+        literal = getLiteralSize(&ops, targetSlice->offset, targetSlice->size);
+        if(srcSlice && srcSlice->size == targetSlice->size
+            && memcmp(
+                src.data + srcSlice->offset,
+                target.data + targetSlice->offset, targetSlice->size
+            ) == 0
+        ){
+            if(verbose) fprintf(
+                out, "  %s: unchanged\n", targetSlice->layout->dest
+            );
+        }else if(srcSlice) fprintf(
+            out, "~ %s: %uB -> %uB, %lluB new\n", targetSlice->layout->dest,
+            srcSlice->size, targetSlice->size, (unsigned long long)literal
+        );
+        else fprintf(
+            out, "+ %s: %uB, %lluB new\n", targetSlice->layout->dest,
+            targetSlice->size, (unsigned long long)literal
+        );
+    }
+    for(size_t i = 0; i < srcSlices.len; i++){
+        bool found = false;
+
+        for(size_t j = 0; j < targetSlices.len; j++) found = found
+            || targetSlices.slices[j].layout->field
+                == srcSlices.slices[i].layout->field;
+        if(!found) fprintf(
+            out, "- %s: %uB\n", srcSlices.slices[i].layout->dest,
+            srcSlices.slices[i].size
+        );
+    }
+
+    literal = getLiteralSize(&ops, 0, target.size);
+    fprintf(
+        out, "%lluB of %zuB new in \"%s\"\n",
+        (unsigned long long)literal, target.size, targetPath
+    );
+    if(deltaFile){
+        uint64_t deltaSize = writeDelta(deltaFile, &ops, &src, &target);
+        fprintf(
+            out, "Wrote %lluB delta to \"%s\" (%.2f%% of \"%s\")\n",
+            (unsigned long long)deltaSize, deltaPath,
+            target.size ? deltaSize * 100.0 / target.size : 0, targetPath
+        );
+        fclose(deltaFile);
+    }
+
+    free(ops.ops);
+    releaseDeltaIndex(&index);
+    unmapImage(&src);
+    unmapImage(&target);
+    fclose(srcFile);
+    fclose(targetFile);
+}
+
+/**
+ * Rebuilds targetPath from srcPath and the delta in deltaPath, checking that
+ * srcPath is what the delta was made from, and targetPath what it was made to.
+ */
+void applyDelta(
+    const char *srcPath, const char *deltaPath, const char *targetPath,
+    bool verbose, FILE *out
+){
+    FILE *srcFile = openFile(srcPath, "r");
+    FILE *deltaFile = openFile(deltaPath, "r");
+    FILE *targetFile;
+    imageMap src = { NULL, 0 };
+    deltaHeader header;
+    struct stat srcStat, targetStat;
+    char tempPath[PATH_MAX];
+    mode_t mask;
+    int fd;
+    uint8_t hash[SHA1_DIGEST_SIZE], *buffer;
+    uint64_t targetSize = 0, srcOffset = 0, op, skip;
+    sha1Context sha;
+    const char *error = NULL;
+
+    if(fread(&header, sizeof(header), 1, deltaFile) != 1
+        || memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic))
+    ) throwError("\"%s\" isn't a boot image delta", deltaPath);
+
+    mapImage(&src, srcFile);
+    hashImage(hash, &src);
+    if(src.size != header.srcSize
+        || memcmp(hash, header.srcHash, SHA1_DIGEST_SIZE)
+    ) throwError("\"%s\" isn't the image this delta is from", srcPath);
+
+    if(!(buffer = malloc(COPY_BUFFER_SIZE))) throwError(
+        "Failed to allocate buffer. %s", strerror(errno)
+    );
+    // The source stays mapped while rebuilding, so it mustn't be written to,
+    // and the target is only replaced once it's known to be good
+    if(fstat(fileno(srcFile), &srcStat)) throwError(
+        "Failed to stat \"%s\". %s", srcPath, strerror(errno)
+    );
+    if(stat(targetPath, &targetStat) == 0
+        && targetStat.st_dev == srcStat.st_dev
+        && targetStat.st_ino == srcStat.st_ino
+    ) throwError("\"%s\" can't be rebuilt over its source", targetPath);
+    if((size_t)snprintf(
+        tempPath, sizeof(tempPath), "%s.XXXXXX", targetPath
+    ) >= sizeof(tempPath)) throwError("\"%s\" is too long", targetPath);
+    if((fd = mkostemp(tempPath, O_CLOEXEC)) < 0) throwError(
+        "Failed to create \"%s\". %s", tempPath, strerror(errno)
+    );
+    mask = umask(0);
+    umask(mask);
+    if(fchmod(fd, 0666 & ~mask) || !(targetFile = fdopen(fd, "w"))){
+        close(fd);
+        unlink(tempPath);
+        throwError("Failed to open \"%s\". %s", tempPath, strerror(errno));
+    }
+    sha1Init(&sha);
+    while(!error && targetSize < header.targetSize){
+        uint64_t size;
+
+        if(!getVarint(deltaFile, &op)){
+            error = "Delta is truncated";
+            break;
+        }
+        size = op >> 1;
+        if(size > header.targetSize - targetSize){
+            error = "Delta overruns the target image";
+            break;
+        }
+
+        if(op & 1){
+            if(!getVarint(deltaFile, &skip)){
+                error = "Delta is truncated";
                 break;
-            default:
-                writeSlice(
-                    srcFile, destFile,
-                    header.page_size, offsetMap[dest], sizeMap[dest]
-                );
+            }
+            srcOffset += (int64_t)(skip >> 1) ^ -(int64_t)(skip & 1);
+            if(srcOffset > src.size || size > src.size - srcOffset){
+                error = "Delta copies from beyond the source image";
+                break;
+            }
+            sha1Update(&sha, src.data + srcOffset, size);
+            fwrite(src.data + srcOffset, size, 1, targetFile);
+            srcOffset += size;
+        }else for(uint64_t left = size; left;){
+            size_t chunk = left < COPY_BUFFER_SIZE ? left : COPY_BUFFER_SIZE;
+            if(fread(buffer, chunk, 1, deltaFile) != 1){
+                error = "Delta is truncated";
+                break;
+            }
+            sha1Update(&sha, buffer, chunk);
+            fwrite(buffer, chunk, 1, targetFile);
+            left -= chunk;
         }
+        targetSize += size;
+    }
 
-        fclose(destFile);
+    if(!error && (fflush(targetFile) || ferror(targetFile)))
+        error = strerror(errno);
+    sha1Final(&sha, hash);
+    if(!error && memcmp(hash, header.targetHash, SHA1_DIGEST_SIZE))
+        error = "Rebuilt image doesn't match the one the delta was made to";
+
+    if(fclose(targetFile) && !error) error = strerror(errno);
+    if(!error && rename(tempPath, targetPath)) error = strerror(errno);
+    fclose(deltaFile);
+    free(buffer);
+    unmapImage(&src);
+    fclose(srcFile);
+    if(error){
+        unlink(tempPath);
+        throwError("Failed to rebuild \"%s\". %s", targetPath, error);
+    }
+    if(verbose) fprintf(
+        out, "Rebuilt %lluB \"%s\" from \"%s\"\n",
+        (unsigned long long)targetSize, targetPath, srcPath
+    );
+}
+
+void usage(char **args){
+    printf(
+        "Usage: %s [OPTIONS] <src>\n"
+        "       %s -b [OPTIONS] [<src>...]\n"
+        "       %s --diff [-o <deltaFile>] <a> <b>\n"
+        "       %s --apply <deltaFile> -o <b> <a>\n\n"
+        "Extracts the kernel, ramdisk, and second-stage bootloader from the\n"
+        "provided Android boot image, and outputs them to the same directory.\n"
+        "Header versions 0 to 4 are supported, along with vendor_boot\n"
+        "images, and any other slices they have (eg. the dtb) are extracted\n"
+        "too.\n"
+        "Furthermore, this also creates a remake script that recombines these\n"
+        "extracted images into newboot.img, by running mkbootimg with the\n"
+        "parameters extracted from the original image header of src.\n\n"
+        "OPTIONS:\n"
+        "\t<src>: The source Android boot image file to extract from. If\n"
+        "\t\tthis is \"-\" or a pipe, it's extracted in a single pass.\n"
+        "\t-d <destDir>: Output extracted images here instead.\n"
+        "\t-v: Verbose.\n"
+        "\t-M: Memory-map src and extract directly from the mapping.\n"
+        "\t-p: Extract every slice (eg. the kernel and ramdisk)\n"
+        "\t\tconcurrently.\n"
+        "\t-S, --sparse: Leave blocks of zeros in the extracted slices as\n"
+        "\t\tholes, rather than writing them out.\n"
+        "\t--simg: Write the extracted slices as Android sparse images,\n"
+        "\t\twith runs of repeated 32 bit values as fill chunks. The\n"
+        "\t\tremake script unsparses them with simg2img, and cuts them\n"
+        "\t\tback to their sizes in the header, as they're padded out\n"
+        "\t\tto whole blocks.\n"
+        "\t-c <cacheDir>, --cache <cacheDir>: Store extracted slices in\n"
+        "\t\tthis content-addressed cache, and reflink or copy them from\n"
+        "\t\tit if they're extracted again. Images are indexed by inode,\n"
+        "\t\tsize, mtime and ctime, so that once extracted, they're never\n"
+        "\t\tread again while unmodified, even for -i.\n"
+        "\t-x <ramdiskDir>: Decompress and unpack the ramdisk into this\n"
+        "\t\tdirectory instead of saving ramdisk.img. The remake script\n"
+        "\t\tthen rebuilds ramdisk.img from it with mkbootfs.\n"
+        "\t-f <format>, --format <format>: Only read the header, and print\n"
+        "\t\tit as a \"json\" line or \"csv\" row. Combined with -b,\n"
+        "\t\tthis scans the headers of many images at once.\n"
+        "\t--verify: Check that the image ID is the SHA-1 of the slices, as\n"
+        "\t\tmkbootimg computes it, hashing them as they're extracted.\n"
+        "\t\tCombined with -i, the slices are only hashed. Slices are\n"
+        "\t\textracted one after another, even with -p.\n"
+        "\t--stats[=json]: After extracting, report the time, and bytes\n"
+        "\t\tread or written, of each phase: opening files, reading\n"
+        "\t\tthe header, copying each slice, writing the remake script,\n"
+        "\t\tand closing the outputs. As text, or as a JSON line. With\n"
+        "\t\t-b, the batch is totalled up too. The text also gives a\n"
+        "\t\tlower bound on the syscalls made, as not all are counted.\n"
+		"\t-i: Print header information only, then exit.\n"
+        "\t-r <remakeScript>: Save the remake script using this filename\n"
+        "\t\tinstead.\n"
+        "\t-m <mkbootimgCmd>: Use this command in the remake script for\n"
+        "\t\tmkbootimg instead. By default, it's mkbootimg for header\n"
+        "\t\tversion 0, or AOSP's mkbootimg.py for anything later.\n"
+        "\t-n <newBootImgName>: Direct the remake script to output the\n"
+        "\t\tremade boot image using this filename instead, rather than\n"
+        "\t\tnewboot.img.\n"
+        "\nBATCH OPTIONS:\n"
+        "\t-b: Extract every src given, each into a directory named after\n"
+        "\t\tthe image minus its extension (eg. boot.img into boot/),\n"
+        "\t\tcreated in destDir if given, or else beside the image.\n"
+        "\t\tNothing is extracted if two images would share one.\n"
+        "\t-l <listFile>: Also extract every image listed in listFile, one\n"
+        "\t\tpath per line, or from stdin if listFile is \"-\".\n"
+        "\t-j <jobs>: Extract this many images at once, rather than one per\n"
+        "\t\tonline CPU.\n"
+        "\nDIFF OPTIONS:\n"
+        "\t--diff <a> <b>: Compare the headers of two images field by\n"
+        "\t\tfield, and their slices block by block, printing what\n"
+        "\t\tchanged from a to b.\n"
+        "\t-o <deltaFile>: Also write a delta that rebuilds b from a.\n"
+        "\t--apply <deltaFile> -o <b> <a>: Rebuild b from a and a delta\n"
+        "\t\twritten by --diff, checking both images against it.\n"
+        "\t-j <jobs>: Hash the blocks of a with this many threads.\n",
+        args[0], args[0], args[0], args[0]
+    );
+}
+
+int main(int argsLen, char **args){
+    unpackOptions opts = {
+        .destDir = NULL,
+        .dests = { "remkbootimg.sh", "newboot.img" },
+        .mkbootimgCmd = NULL,
+        .ramdiskDir = NULL,
+        .cacheDir = NULL,
+        .scanFormat = SCAN_NONE,
+        .stats = STATS_NONE,
+        .verbose = false, .onlyPrintHeader = false, .useMap = false,
+        .concurrent = false, .verify = false, .sparse = false,
+        .simg = false
+    };
+    enum { OPT_VERIFY = 256, OPT_SIMG, OPT_DIFF, OPT_APPLY, OPT_STATS };
+    const struct option longOpts[] = {
+        { "verify", no_argument, NULL, OPT_VERIFY },
+        { "format", required_argument, NULL, 'f' },
+        { "sparse", no_argument, NULL, 'S' },
+        { "simg", no_argument, NULL, OPT_SIMG },
+        { "cache", required_argument, NULL, 'c' },
+        { "diff", no_argument, NULL, OPT_DIFF },
+        { "apply", required_argument, NULL, OPT_APPLY },
+        { "stats", optional_argument, NULL, OPT_STATS },
+        { NULL, 0, NULL, 0 }
+    };
+    batchQueue queue = { NULL, 0, 0, 0, 0, &opts, false };
+    char *src = NULL;
+    char destDir[PATH_MAX];
+    const char *outPath = NULL, *deltaPath = NULL;
+    char *end;
+    bool batch = false, diff = false;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    unpackState state = UNPACK_STATE_INIT;
+
+    // Parse supplied arguments
+    int opt = 0;
+    while((opt = getopt_long(
+        argsLen, args, "-s:d:vMpSx:c:ir:m:n:bl:j:f:o:", longOpts, NULL
+    )) >= 0) switch(opt){
+		case 1:
+            if(src) pushBatchImage(&queue, src);
+            src = optarg;
+            break;
+        case 'd': opts.destDir = optarg; break;
+        case 'v': opts.verbose = true; opts.onlyPrintHeader = false; break;
+        case 'M': opts.useMap = true; break;
+        case 'p': opts.concurrent = true; break;
+        case 'S': opts.sparse = true; break;
+        case 'x': opts.ramdiskDir = optarg; break;
+        case 'c': opts.cacheDir = optarg; break;
+		case 'i': opts.onlyPrintHeader = true; opts.verbose = false; break;
+        case 'r': opts.dests[DEST_MKSCRIPT] = optarg; break;
+        case 'm': opts.mkbootimgCmd = optarg; break;
+        case 'n': opts.dests[DEST_NEWBOOT] = optarg; break;
+        case 'b': batch = true; break;
+        case 'l': batch = true; readBatchList(&queue, optarg); break;
+        case 'j':
+            jobs = strtol(optarg, &end, 10);
+            if(*end || end == optarg || jobs < 1){
+                usage(args);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_VERIFY: opts.verify = true; break;
+        case OPT_SIMG: opts.simg = true; break;
+        case OPT_DIFF: diff = true; break;
+        case OPT_APPLY: deltaPath = optarg; break;
+        case 'o': outPath = optarg; break;
+        case OPT_STATS:
+            if(!optarg || strcmp(optarg, "text") == 0)
+                opts.stats = STATS_TEXT;
+            else if(strcmp(optarg, "json") == 0) opts.stats = STATS_JSON;
+            else{
+                usage(args);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            if(strcmp(optarg, "json") == 0) opts.scanFormat = SCAN_JSON;
+            else if(strcmp(optarg, "csv") == 0) opts.scanFormat = SCAN_CSV;
+            else{
+                usage(args);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(args);
+            return EXIT_FAILURE;
     };
 
+    if(diff || deltaPath){
+        // --diff takes two images, and --apply one
+        bool ok = !batch && src && queue.srcsLen == (diff ? 1 : 0)
+            && !(diff && deltaPath) && (diff || outPath);
+
+        if(ok && diff) diffImages(
+            queue.srcs[0], src, outPath, jobs, opts.verbose, stdout
+        );
+        else if(ok) applyDelta(src, deltaPath, outPath, opts.verbose, stdout);
+        else usage(args);
+        for(size_t i = 0; i < queue.srcsLen; i++) free(queue.srcs[i]);
+        free(queue.srcs);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if(outPath){
+        // -o only names the output of --diff and --apply
+        usage(args);
+        return EXIT_FAILURE;
+    }
+
+    if(batch || queue.srcsLen){
+        if(src) pushBatchImage(&queue, src);
+        if(!batch || queue.srcsLen == 0){
+            usage(args);
+            return EXIT_FAILURE;
+        }
+
+        if(opts.scanFormat == SCAN_CSV) writeScanColumns(stdout);
+        size_t failed = runBatch(&queue, jobs);
+        for(size_t i = 0; i < queue.srcsLen; i++) free(queue.srcs[i]);
+        free(queue.srcs);
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if(src == NULL){
+        usage(args);
+        return EXIT_FAILURE;
+    }
+
+    if(opts.scanFormat){
+        if(opts.scanFormat == SCAN_CSV) writeScanColumns(stdout);
+        return scanImage(src, opts.scanFormat, stdout)
+            ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Default to extracting into src's parent directory
+    if(opts.destDir == NULL){
+        getEnclosingDir(destDir, PATH_MAX, src);
+        opts.destDir = destDir;
+    }
+
+    unpackImage(src, opts.destDir, &opts, stdout, &state);
+    finishUnpack(src, &opts, stdout, &state);
+
     // Cleanup
-    fclose(srcFile);
-    if(destDirMalloced) free(destDir);
+    releaseUnpackState(&state);
 
     return EXIT_SUCCESS;
 }
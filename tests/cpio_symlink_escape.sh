@@ -0,0 +1,50 @@
+#!/bin/sh
+# A ramdisk whose symlink entry is followed by an entry beneath it must not
+# be able to write outside the directory it's unpacked into with -x.
+set -e
+
+BIN=${BIN:-bin}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# Writes n NUL bytes
+pad(){
+    i=0
+    while [ "$i" -lt "$1" ]; do printf '\0'; i=$((i + 1)); done
+}
+
+# Writes a newc cpio entry with the given name, mode and data
+entry(){
+    namesize=$((${#1} + 1))
+    printf '070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X' \
+        1 "$2" 0 0 1 0 "${#3}" 0 0 0 0 "$namesize" 0
+    printf '%s\0' "$1"
+    pad $(((4 - (110 + namesize) % 4) % 4))
+    printf '%s' "$3"
+    pad $(((4 - ${#3} % 4) % 4))
+}
+
+mkdir "$TMP/outside"
+{
+    entry evil 0xA1FF "$TMP/outside"
+    entry evil/pwned 0x81A4 "escaped"
+    entry dir 0x41ED ""
+    entry dir/ok 0x81A4 "kept"
+    entry TRAILER!!! 0 ""
+} > "$TMP/ramdisk.cpio"
+printf 'kernel' > "$TMP/kernel"
+
+"$BIN/mkbootimg" --kernel "$TMP/kernel" --ramdisk "$TMP/ramdisk.cpio" \
+    -o "$TMP/boot.img" > /dev/null
+"$BIN/unmkbootimg" -d "$TMP/out" -x "$TMP/ramdisk" "$TMP/boot.img" \
+    > /dev/null 2>&1
+
+if [ -e "$TMP/outside/pwned" ]; then
+    echo "FAIL: evil/pwned was written through the evil symlink" >&2
+    exit 1
+fi
+if [ "$(cat "$TMP/ramdisk/dir/ok")" != kept ]; then
+    echo "FAIL: dir/ok wasn't unpacked" >&2
+    exit 1
+fi
+echo "PASS: cpio_symlink_escape"
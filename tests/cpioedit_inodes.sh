@@ -0,0 +1,59 @@
+#!/bin/sh
+# Entries added by cpioedit mustn't share an inode with any entry that comes
+# after them, and anything appended after the trailer must be kept.
+set -e
+
+BIN=${BIN:-bin}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# Writes n NUL bytes
+pad(){
+    i=0
+    while [ "$i" -lt "$1" ]; do printf '\0'; i=$((i + 1)); done
+}
+
+# Writes a newc cpio entry with the given inode, name, mode and data
+entry(){
+    namesize=$((${#2} + 1))
+    printf '070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X' \
+        "$1" "$3" 0 0 1 0 "${#4}" 0 0 0 0 "$namesize" 0
+    printf '%s\0' "$2"
+    pad $(((4 - (110 + namesize) % 4) % 4))
+    printf '%s' "$4"
+    pad $(((4 - ${#4} % 4) % 4))
+}
+
+{
+    entry 1 a 0x41ED ""
+    entry 2 a/x 0x81A4 "x"
+    entry 3 b 0x81A4 "b"
+    entry 0 TRAILER!!! 0 ""
+    pad 128
+    entry 7 appended 0x81A4 "appended"
+    entry 0 TRAILER!!! 0 ""
+} > "$TMP/ramdisk.cpio"
+printf 'new' > "$TMP/new"
+
+# Fails if any inode in the edited archive is repeated, or if what was
+# appended to it is missing
+check(){
+    dupes=$(grep -a -o '070701[0-9A-F]\{8\}' "$1" | cut -c7-14 \
+        | grep -v "^00000000$" | sort | uniq -d)
+    if [ -n "$dupes" ]; then
+        echo "FAIL: cpioedit_inodes ($2): inode $dupes is repeated"
+        exit 1
+    fi
+    if ! grep -a -q appended "$1"; then
+        echo "FAIL: cpioedit_inodes ($2): appended archive was dropped"
+        exit 1
+    fi
+}
+
+"$BIN/cpioedit" -a a/new="$TMP/new" "$TMP/ramdisk.cpio" \
+    -o "$TMP/file.cpio" 2> /dev/null
+check "$TMP/file.cpio" file
+"$BIN/cpioedit" -a a/new="$TMP/new" - < "$TMP/ramdisk.cpio" \
+    > "$TMP/stream.cpio" 2> /dev/null
+check "$TMP/stream.cpio" stream
+echo "PASS: cpioedit_inodes"
@@ -0,0 +1,59 @@
+#!/bin/sh
+# A ramdisk made of several compressed streams, each its own cpio archive
+# and padded with zeros, must be unpacked in full with -x, as the kernel
+# would, rather than stopping at the end of the first stream.
+set -e
+
+BIN=${BIN:-bin}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# Writes n NUL bytes
+pad(){
+    i=0
+    while [ "$i" -lt "$1" ]; do printf '\0'; i=$((i + 1)); done
+}
+
+# Writes a newc cpio entry with the given name, mode and data
+entry(){
+    namesize=$((${#1} + 1))
+    printf '070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X' \
+        1 "$2" 0 0 1 0 "${#3}" 0 0 0 0 "$namesize" 0
+    printf '%s\0' "$1"
+    pad $(((4 - (110 + namesize) % 4) % 4))
+    printf '%s' "$3"
+    pad $(((4 - ${#3} % 4) % 4))
+}
+
+# Writes an archive holding just the named file, padded as mkbootfs would
+archive(){
+    { entry "$1" 0x81A4 "$1"; entry TRAILER!!! 0 ""; } > "$TMP/part"
+    cat "$TMP/part"
+    pad $(((256 - $(wc -c < "$TMP/part") % 256) % 256))
+}
+
+printf 'kernel' > "$TMP/kernel"
+for compress in gzip xz lzma; do
+    if ! command -v "$compress" > /dev/null; then
+        echo "SKIP: ramdisk_concat ($compress isn't installed)"
+        continue
+    fi
+    {
+        archive first | "$compress" -c
+        pad 3
+        archive second | "$compress" -c
+    } > "$TMP/ramdisk"
+
+    "$BIN/mkbootimg" --kernel "$TMP/kernel" --ramdisk "$TMP/ramdisk" \
+        -o "$TMP/boot.img" > /dev/null
+    rm -rf "$TMP/out" "$TMP/root"
+    "$BIN/unmkbootimg" -d "$TMP/out" -x "$TMP/root" "$TMP/boot.img" \
+        > /dev/null
+    for name in first second; do
+        if [ "$(cat "$TMP/root/$name" 2> /dev/null)" != "$name" ]; then
+            echo "FAIL: ramdisk_concat ($compress): $name is missing"
+            exit 1
+        fi
+    done
+done
+echo "PASS: ramdisk_concat"